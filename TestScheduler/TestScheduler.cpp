@@ -3,8 +3,223 @@ using namespace TinyNet;
 
 #pragma comment(lib, "TinyNet.lib")
 
-int main()
+/// the priority queue scheduler the wheel replaced, kept to compare with
+
+class HeapScheduler
 {
+public:
+    HeapScheduler() : _running(0), _timerNext(0)
+    {
+    }
+
+    void Start()
+    {
+        if (InterlockedCompareExchange(&_running, 1, 0) == 0) {
+            _thread = std::thread(&HeapScheduler::MainLoop, this);
+        }
+    }
+
+    void Close()
+    {
+        if (InterlockedCompareExchange(&_running, 0, 1) == 1 && _thread.joinable()) {
+            {
+                LockGuard guard(_timerLock);
+                _condition.notify_one();
+            }
+
+            _thread.join();
+        }
+    }
+
+    uint32_t Schedule(const std::function<void()>& func, uint32_t delay, uint32_t period = 0)
+    {
+        TimerPtr timer(new Timer);
+        timer->_action  = func;
+        timer->_period  = period;
+        timer->_running = false;
+        timer->_retired = false;
+        timer->_dueTime = GetTickCount() + delay;
+
+        uint32_t name = InterlockedIncrement(&_timerNext);
+        timer->_name = name;
+
+        LockGuard guard(_timerLock);
+        _timerMap.emplace(name, timer);
+        _timerQueue.push(timer);
+
+        _condition.notify_one();
+        return name;
+    }
+
+    void ShutDown(uint32_t name)
+    {
+        LockGuard guard(_timerLock);
+
+        auto iter = _timerMap.find(name);
+        if (iter != _timerMap.end()) {
+            iter->second->_retired = true;
+
+            while (iter->second->_running) {
+                if (std::this_thread::get_id() == _thread.get_id())
+                    return;
+
+                ::Sleep(1);
+            }
+        }
+    }
+private:
+    void MainLoop()
+    {
+        while (true) {
+            TimerPtr timer;
+            while (_running) {
+                LockGuard guard(_timerLock);
+
+                uint32_t curTime = GetTickCount();
+                uint32_t dueTime = curTime + 1000;
+                if (_timerQueue.size() > 0) {
+                    TimerPtr topper = _timerQueue.top();
+                    if (topper->_retired) {
+                        _timerQueue.pop();
+                        continue;
+                    }
+
+                    dueTime = topper->_dueTime;
+                    if (dueTime <= curTime) {
+                        timer = topper;
+                        timer->_running = true;
+                        _timerQueue.pop();
+                        break;
+                    }
+                }
+
+                std::chrono::duration<int, std::milli> elapsed(dueTime - curTime);
+                _condition.wait_for(guard, elapsed);
+            }
+
+            if (!_running) break;
+
+            try
+            {
+                timer->_action();
+            }
+            catch(...)
+            {
+            }
+
+            timer->_running = false;
+
+            LockGuard guard(_timerLock);
+            if (timer->_period == 0) {
+                _timerMap.erase(timer->_name);
+            } else {
+                timer->_dueTime += timer->_period;
+                _timerQueue.push(timer);
+            }
+        }
+    }
+
+    struct Timer
+    {
+        uint32_t    _name;
+
+        uint32_t    _dueTime;
+        uint32_t    _period;
+
+        volatile bool    _running;
+        volatile bool    _retired;
+
+        std::function<void()>    _action;
+    };
+
+    typedef std::shared_ptr<Timer> TimerPtr;
+
+    struct TimerComparer
+    {
+        bool operator()(const TimerPtr& lhs, const TimerPtr& rhs)
+        {
+            return lhs->_dueTime > rhs->_dueTime;
+        }
+    };
+
+    typedef std::unique_lock<std::mutex> LockGuard;
+
+    std::thread    _thread;
+    uint32_t       _running;
+
+    std::mutex    _timerLock;
+    std::map<uint32_t, TimerPtr>    _timerMap;
+    std::priority_queue<TimerPtr, std::vector<TimerPtr>, TimerComparer>    _timerQueue;
+
+    volatile uint32_t    _timerNext;
+
+    std::condition_variable    _condition;
+};
+
+
+/// count timers due in 10 to 70 s scheduled and shut down, then as many due
+/// in 1 to 1.5 s left to fire, later than scheduling them takes, lateness is
+/// from their due time
+
+template<class S>
+void Bench(const char* tag, uint32_t count)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    S* scheduler = new S;
+    scheduler->Start();
+
+    std::vector<uint32_t> names(count);
+    uint32_t seed = 1;
+    auto random = [&seed] { seed = seed * 1103515245 + 12345; return seed >> 8; };
+
+    auto start = Clock::now();
+    for (uint32_t i = 0; i < count; i++) {
+        names[i] = scheduler->Schedule([] { }, 10000 + random() % 60000);
+    }
+
+    auto scheduled = Clock::now();
+    for (uint32_t i = 0; i < count; i++) {
+        scheduler->ShutDown(names[i]);
+    }
+    auto shutdown = Clock::now();
+
+    std::atomic<uint32_t> fired(0);
+    std::atomic<int64_t>  lateMax(0);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t delay = 1000 + random() % 500;
+        Clock::time_point due = Clock::now() + std::chrono::milliseconds(delay);
+        scheduler->Schedule([&fired, &lateMax, due] {
+            int64_t late = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - due).count();
+            int64_t max = lateMax.load();
+            while (late > max && !lateMax.compare_exchange_weak(max, late)) { }
+            fired++;
+        }, delay);
+    }
+
+    while (fired < count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    printf("%s schedule %.0f ns, shutdown %.0f ns, late max %.1f ms\n", tag,
+        std::chrono::duration<double, std::nano>(scheduled - start).count() / count,
+        std::chrono::duration<double, std::nano>(shutdown - scheduled).count() / count,
+        lateMax.load() / 1000.0);
+
+    scheduler->Close();
+    delete scheduler;
+}
+
+int main(int argc, char* argv[])
+{
+    /// TestScheduler bench [count]
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        uint32_t count = argc > 2 ? (uint32_t)atoi(argv[2]) : 200000;
+        Bench<HeapScheduler>("heap ", count);
+        Bench<Scheduler>("wheel", count);
+        return 0;
+    }
+
     theScheduler.Start();
 
     uint32_t timer1 = theScheduler.Schedule([=] {
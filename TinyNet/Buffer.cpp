@@ -1,4 +1,5 @@
 #include "Buffer.h"
+#include "Pool.h"
 
 
 TINYNET_START()
@@ -7,10 +8,11 @@ BufferPtr Buffer::Create(size_t size)
 {
     if (size < 64) { size = 64; }
 
-    Buffer* buffer = (Buffer*)malloc(sizeof(Buffer) + size);
+    auto refer = RefCount_Pool<Buffer>::Create(sizeof(Buffer) + size, size);
+    Buffer* buffer = refer->Get();
     buffer->_base = (uint8_t*)(buffer + 1);
-    buffer->_last = buffer->_base + size;
-    return BufferPtr(buffer, free);
+    buffer->_last = (uint8_t*)buffer + size;
+    return BufferPtr::Adopt(refer);
 }
 
 TINYNET_CLOSE()
\ No newline at end of file
@@ -16,12 +16,18 @@ public:
     void Write(const void* data, size_t size)
     {
         if (_base + size > _last)
-            throw std::exception("Buffer::Write, Range Overflow");
+            throw std::runtime_error("Buffer::Write, Range Overflow");
 
         memcpy(_base, data, size);
         _base += size;
     }
 
+    /// first byte of the space, _base moves on as it is written
+    uint8_t* Start()
+    {
+        return (uint8_t*)(this + 1);
+    }
+
     uint8_t*   _base;
     uint8_t*   _last;
 };
@@ -0,0 +1,256 @@
+#include "Compress.h"
+
+
+TINYNET_START()
+
+namespace {
+
+const uint32_t HashBits = 14;
+const size_t   MinMatch = 4;
+
+/// window kept plus the largest message
+const size_t HistorySize = 3 * 65536;
+
+inline uint32_t Read32(const uint8_t* data)
+{
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+inline uint64_t Read64(const uint8_t* data)
+{
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return value;
+}
+
+/// trailing zero bits, the first differing byte on little endian
+inline uint32_t CountZero(uint64_t value)
+{
+#if defined(_WIN32)
+    /// no 64 bit scan on x86, value is never 0
+    unsigned long index;
+    if (_BitScanForward(&index, (unsigned long)value))
+        return index;
+
+    _BitScanForward(&index, (unsigned long)(value >> 32));
+    return index + 32;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+inline uint32_t Hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HashBits);
+}
+
+inline uint8_t* PutLength(uint8_t* out, size_t length)
+{
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+/// false when the data ends inside the length
+inline bool GetLength(const uint8_t*& at, const uint8_t* end, size_t& length)
+{
+    uint8_t byte;
+    do {
+        if (at == end)
+            return false;
+
+        byte = *at++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+}
+
+Compressor::Compressor() :
+    _history(HistorySize), _used(0), _table((size_t)1 << HashBits, 0)
+{
+}
+
+void Compressor::Append(const uint8_t* data, size_t size)
+{
+    if (size > HistorySize - Window)
+        throw std::runtime_error("Compressor::Append, Message Too Large");
+
+    if (_used + size > HistorySize) {
+        size_t delta = _used - Window;
+        memmove(_history.data(), _history.data() + delta, Window);
+        _used = Window;
+
+        for (auto& entry : _table) {
+            entry = entry > delta ? entry - (uint32_t)delta : 0;
+        }
+    }
+
+    memcpy(_history.data() + _used, data, size);
+    _used += size;
+}
+
+size_t Compressor::Compress(const uint8_t* data, size_t size, uint8_t* out, size_t capacity)
+{
+    Append(data, size);
+
+    const uint8_t* base = _history.data();
+    const uint8_t* end  = base + _used;
+    const uint8_t* ip   = end - size;
+    const uint8_t* anchor = ip;
+
+    /// give up once the output is no smaller than the input
+    capacity = std::min(capacity, size);
+    uint8_t* op = out;
+    uint8_t* last = out + capacity;
+
+    /// steps grow over a run of misses, data that does not compress is passed quickly
+    size_t misses = 0;
+    while (ip + MinMatch <= end) {
+        uint32_t value = Read32(ip);
+        uint32_t& entry = _table[Hash(value)];
+        const uint8_t* ref = entry != 0 ? base + entry - 1 : nullptr;
+        entry = (uint32_t)(ip - base) + 1;
+
+        if (ref == nullptr || ip - ref > (ptrdiff_t)Window || Read32(ref) != value) {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        size_t match = MinMatch;
+        while (ip + match + 8 <= end) {
+            uint64_t diff = Read64(ip + match) ^ Read64(ref + match);
+            if (diff != 0) {
+                match += CountZero(diff) / 8;
+                break;
+            }
+            match += 8;
+        }
+        if (ip + match + 8 > end) {
+            while (ip + match < end && ref[match] == ip[match]) {
+                match++;
+            }
+        }
+
+        size_t literal = ip - anchor;
+        if (op + 1 + literal / 255 + 1 + literal + 2 + match / 255 + 1 > last)
+            return 0;
+
+        uint8_t* token = op++;
+        *token = (uint8_t)((std::min<size_t>(literal, 15) << 4) | std::min<size_t>(match - MinMatch, 15));
+        if (literal >= 15) { op = PutLength(op, literal - 15); }
+        memcpy(op, anchor, literal);
+        op += literal;
+
+        uint16_t offset = (uint16_t)(ip - ref);
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (match - MinMatch >= 15) { op = PutLength(op, match - MinMatch - 15); }
+
+        ip += match;
+        anchor = ip;
+    }
+
+    /// the rest as literals, the input ends right after them
+    size_t literal = end - anchor;
+    if (op + 1 + literal / 255 + 1 + literal >= last)
+        return 0;
+
+    *op++ = (uint8_t)(std::min<size_t>(literal, 15) << 4);
+    if (literal >= 15) { op = PutLength(op, literal - 15); }
+    memcpy(op, anchor, literal);
+    op += literal;
+
+    return op - out;
+}
+
+Decompressor::Decompressor() :
+    _history(HistorySize), _used(0)
+{
+}
+
+void Decompressor::Reserve(size_t size)
+{
+    if (size > HistorySize - Compressor::Window)
+        throw std::runtime_error("Decompressor::Reserve, Message Too Large");
+
+    if (_used + size > HistorySize) {
+        size_t delta = _used - Compressor::Window;
+        memmove(_history.data(), _history.data() + delta, Compressor::Window);
+        _used = Compressor::Window;
+    }
+}
+
+void Decompressor::Append(const uint8_t* data, size_t size)
+{
+    Reserve(size);
+    memcpy(_history.data() + _used, data, size);
+    _used += size;
+}
+
+bool Decompressor::Decompress(const uint8_t* data, size_t size, size_t limit, const uint8_t*& raw, size_t& rawSize)
+{
+    Reserve(limit);
+
+    uint8_t* base = _history.data();
+    uint8_t* start = base + _used;
+    uint8_t* op = start;
+    uint8_t* last = start + limit;
+
+    const uint8_t* ip  = data;
+    const uint8_t* end = data + size;
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        size_t literal = token >> 4;
+        if (literal == 15 && !GetLength(ip, end, literal))
+            return false;
+        if (literal > (size_t)(end - ip) || literal > (size_t)(last - op))
+            return false;
+
+        memcpy(op, ip, literal);
+        op += literal;
+        ip += literal;
+
+        /// the last sequence has no match
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return false;
+
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t match = (token & 15) + MinMatch;
+        if ((token & 15) == 15 && !GetLength(ip, end, match))
+            return false;
+        if (offset == 0 || offset > (size_t)(op - base) || match > (size_t)(last - op))
+            return false;
+
+        /// may overlap what it writes when close
+        const uint8_t* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+        } else {
+            for (size_t i = 0; i < match; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += match;
+    }
+
+    raw = start;
+    rawSize = op - start;
+    _used += rawSize;
+    return true;
+}
+
+TINYNET_CLOSE()
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include "Require.h"
+
+
+TINYNET_START()
+
+/// lz77 in the lz4 block layout, every message of a connection is matched
+/// against the last Window bytes of the messages before it, so both sides
+/// have to see the same messages in the same order
+
+class Compressor
+{
+    NOCOPYASSIGN(Compressor);
+public:
+    static const size_t Window = 65535;
+
+    Compressor();
+
+    /// worst case output for size bytes of input
+    static size_t Bound(size_t size)
+    {
+        return size + size / 255 + 16;
+    }
+
+    /// returns the compressed size, 0 when it would not be smaller, the
+    /// data goes into the history either way
+    size_t Compress(const uint8_t* data, size_t size, uint8_t* out, size_t capacity);
+
+    /// history only, for messages sent raw
+    void Append(const uint8_t* data, size_t size);
+private:
+    std::vector<uint8_t>     _history;
+    size_t                   _used;
+
+    /// position + 1 of the last 4 bytes with the hash, 0 when none
+    std::vector<uint32_t>    _table;
+};
+
+
+class Decompressor
+{
+    NOCOPYASSIGN(Decompressor);
+public:
+    Decompressor();
+
+    /// at most limit bytes come out, raw points into the history and stays
+    /// valid until the next call, false when the data is corrupt
+    bool Decompress(const uint8_t* data, size_t size, size_t limit, const uint8_t*& raw, size_t& rawSize);
+
+    /// history only, for messages received raw
+    void Append(const uint8_t* data, size_t size);
+private:
+    /// keeps the last Window bytes and room for size more
+    void Reserve(size_t size);
+
+    std::vector<uint8_t>    _history;
+    size_t                  _used;
+};
+
+TINYNET_CLOSE()
\ No newline at end of file
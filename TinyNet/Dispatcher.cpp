@@ -3,20 +3,30 @@
 
 TINYNET_START()
 
+Dispatcher::~Dispatcher()
+{
+    Close();
+
+    for (auto worker : _workers) {
+        delete worker;
+    }
+}
+
 void Dispatcher::Start(uint32_t threadCount)
 {
     if (InterlockedCompareExchange(&_running, 1, 0) == 0) {
         if (threadCount == 0) {
-            SYSTEM_INFO info;
-            GetSystemInfo(&info);
-            threadCount = info.dwNumberOfProcessors;
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        /// workers are kept after Close, events enqueued late have somewhere to go
+        while (_workers.size() < threadCount) {
+            _workers.push_back(new Worker);
         }
 
         _threadCount = threadCount;
         for (uint32_t i = 0; i < _threadCount; i++) {
-            _threads[i] = CreateThread(NULL, 0, Dispatcher::ThreadProc, 0, 0, NULL);
-            if (_threads[i] == NULL)
-                throw std::exception("Dispatcher::Start, 1");
+            _threads.push_back(std::thread(&Dispatcher::MainLoop, this, i));
         }
     }
 }
@@ -24,133 +34,245 @@ void Dispatcher::Start(uint32_t threadCount)
 void Dispatcher::Close()
 {
     if (InterlockedCompareExchange(&_running, 0, 1) == 1) {
-        WaitForMultipleObjects(_threadCount, _threads, TRUE, INFINITE);
-        for (uint32_t i = 0; i < _threadCount; i++) {
-            _threads[i] = NULL;
+        {
+            std::lock_guard<std::mutex> guard(_parkLock);
+            _parkCond.notify_all();
+        }
+
+        for (auto& thread : _threads) {
+            thread.join();
+        }
+        _threads.clear();
+
+        for (auto worker : _workers) {
+            MutexGuard guard(worker->_lock);
+            _pending -= (uint32_t)worker->_queues.size();
+            worker->_queues.clear();
         }
-        
+
         MutexGuard guard(_eventQueueLock);
         _socketHanlder2EventQueue.clear();
-        _socketEventQueueList.clear();
         _serverEventQueue.Reset();
     }
 }
 
-void Dispatcher::Enqueue(SocketEvent&& socketEvent)
+void Dispatcher::SetQuantum(uint32_t count, uint32_t micros)
+{
+    _quantumCount.store(std::max(count, 1u), std::memory_order_relaxed);
+    _quantumTime.store(micros, std::memory_order_relaxed);
+}
+
+SocketEventQueuePtr Dispatcher::Attach(SocketHandlerPtr& handler)
 {
     MutexGuard guard(_eventQueueLock);
-    
+
     SocketEventQueuePtr socketEventQueue;
-    if (socketEvent._handler.Get()) {
-        auto iter = _socketHanlder2EventQueue.find(socketEvent._handler);
-        if (iter != _socketHanlder2EventQueue.end()) {
-            socketEventQueue = iter->second;
-        } else {
-            socketEventQueue = SocketEventQueuePtr(new SocketEventQueue);
-            socketEventQueue->_work = false;
-            socketEventQueue->_wait = false;
-            socketEventQueue->_active = 0;
-            _socketHanlder2EventQueue.insert(std::make_pair(socketEvent._handler, socketEventQueue));
-        }
+    auto iter = _socketHanlder2EventQueue.find(handler);
+    if (iter != _socketHanlder2EventQueue.end()) {
+        socketEventQueue = iter->second;
     } else {
+        socketEventQueue = MakeShared<SocketEventQueue>();
+        socketEventQueue->_wait = false;
+        socketEventQueue->_sockets = 0;
+        _socketHanlder2EventQueue.insert(std::make_pair(handler, socketEventQueue));
+    }
+
+    socketEventQueue->_sockets++;
+    return socketEventQueue;
+}
+
+void Dispatcher::Detach(SocketEventQueuePtr& socketEventQueue, SocketHandlerPtr& handler)
+{
+    MutexGuard guard(_eventQueueLock);
+
+    if (--socketEventQueue->_sockets == 0) {
+        MutexGuard queueGuard(socketEventQueue->_lock);
+        auto iter = _socketHanlder2EventQueue.find(handler);
+        if (iter != _socketHanlder2EventQueue.end() && iter->second.Get() == socketEventQueue.Get() && socketEventQueue->_list.empty()) {
+            _socketHanlder2EventQueue.erase(iter);
+        }
+    }
+}
+
+void Dispatcher::Enqueue(SocketEventQueuePtr& socketEventQueue, SocketEvent&& socketEvent)
+{
+    bool schedule = false;
+    {
+        MutexGuard guard(socketEventQueue->_lock);
+        socketEventQueue->_list.push_back(std::move(socketEvent));
+
+        if (!socketEventQueue->_wait && !_workers.empty()) {
+            socketEventQueue->_wait = true;
+            schedule = true;
+        }
+    }
+
+    if (schedule) {
+        Schedule(socketEventQueue, _next++);
+    }
+}
+
+void Dispatcher::Enqueue(SocketEvent&& socketEvent)
+{
+    SocketEventQueuePtr socketEventQueue;
+    {
+        MutexGuard guard(_eventQueueLock);
         if (_serverEventQueue.Get() == nullptr) {
-            _serverEventQueue = SocketEventQueuePtr(new SocketEventQueue);
-            _serverEventQueue->_work = false;
+            _serverEventQueue = MakeShared<SocketEventQueue>();
             _serverEventQueue->_wait = false;
-            _serverEventQueue->_active = 1;
+            _serverEventQueue->_sockets = 0;
         }
 
         socketEventQueue = _serverEventQueue;
     }
-    
+
+    Enqueue(socketEventQueue, std::move(socketEvent));
+}
+
+void Dispatcher::Schedule(SocketEventQueuePtr& socketEventQueue, uint32_t index)
+{
+    Worker* worker = _workers[index % _workers.size()];
     {
-        MutexGuard queueGuard(socketEventQueue->_lock);
-        socketEventQueue->_list.push_back(std::move(socketEvent));
+        MutexGuard guard(worker->_lock);
+        worker->_queues.push_back(socketEventQueue);
     }
 
-    Enqueue(socketEventQueue, false);
+    /// pairs with Park, either the worker sees _pending or we see it idle
+    _pending++;
+    if (_idle > 0) {
+        std::lock_guard<std::mutex> guard(_parkLock);
+        _parkCond.notify_one();
+    }
 }
 
-void Dispatcher::Enqueue(SocketEventQueuePtr& socketEventQueue, bool resetFlag)
+SocketEventQueuePtr Dispatcher::Dequeue(uint32_t index)
 {
-    MutexGuard guard(_eventQueueLock);
+    for (size_t i = 0; i < _workers.size(); i++) {
+        Worker* worker = _workers[(index + i) % _workers.size()];
 
-    if (resetFlag) {
-        socketEventQueue->_work = false;
+        MutexGuard guard(worker->_lock);
+        if (!worker->_queues.empty()) {
+            SocketEventQueuePtr socketEventQueue = std::move(worker->_queues.front());
+            worker->_queues.pop_front();
+            _pending--;
+            return socketEventQueue;
+        }
     }
+    return SocketEventQueuePtr();
+}
+
+void Dispatcher::Park()
+{
+    std::unique_lock<std::mutex> guard(_parkLock);
 
-    if (socketEventQueue->_list.size() > 0 && !socketEventQueue->_wait && !socketEventQueue->_work) {
-        socketEventQueue->_wait = true;
-        _socketEventQueueList.push_back(socketEventQueue);
+    _idle++;
+    while (_pending == 0 && _running) {
+        _parkCond.wait(guard);
     }
+    _idle--;
 }
 
-SocketEventQueuePtr Dispatcher::Dequeue()
+void Dispatcher::Handle(SocketEventQueuePtr& socketEventQueue, SocketEvent& socketEvent)
 {
-    MutexGuard guard(_eventQueueLock);
-    if (_socketEventQueueList.empty())
-        return SocketEventQueuePtr();
+    /// the handler may take the packet
+    RecvWindow* window = socketEvent._window.Get();
+    uint32_t bytes = window != nullptr ? socketEvent._packet->_used : 0;
 
-    SocketEventQueuePtr socketEventQueue = _socketEventQueueList.front();
-    _socketEventQueueList.pop_front();
+    switch (socketEvent._type)
+    {
+    case Socket_Connect:
+        socketEvent._handler->OnStart(socketEvent._name, socketEvent._status);
+        if (!socketEvent._status) {
+            Detach(socketEventQueue, socketEvent._handler);
+        }
+        break;
+    case Socket_Receive:
+        socketEvent._handler->OnReceive(socketEvent._name, socketEvent._packet);
+        break;
+    case Socket_Stream:
+        socketEvent._handler->OnStream(socketEvent._name, socketEvent._packet, socketEvent._status);
+        break;
+    case Socket_Backpressure:
+        if (socketEvent._status) {
+            socketEvent._handler->OnBackpressure(socketEvent._name);
+        } else {
+            socketEvent._handler->OnWritable(socketEvent._name);
+        }
+        break;
+    case Socket_WriteIdle:
+        socketEvent._handler->OnWriteIdle(socketEvent._name);
+        break;
+    case Socket_Close:
+        if (socketEvent._handler.Get()) {
+            socketEvent._handler->OnClose(socketEvent._name);
+            Detach(socketEventQueue, socketEvent._handler);
+        } else {
+            socketEvent._serverHandler->OnClose(socketEvent._name);
+        }
+        break;
+    default:
+        throw std::runtime_error("Dispatcher::Handle, Unknown EventType");
+        break;
+    }
 
-    socketEventQueue->_work = true;
-    socketEventQueue->_wait = false;
-    return socketEventQueue;
+    if (window != nullptr) {
+        window->_events--;
+        window->_bytes -= bytes;
+        if (window->_paused && window->UnderLow() && window->_paused.exchange(false)) {
+            theManager.Resume(socketEvent._name);
+        }
+    }
 }
 
-void Dispatcher::MainLoop()
+void Dispatcher::MainLoop(uint32_t index)
 {
     while (_running) {
-        SocketEventQueuePtr socketEventQueue = Dequeue();
-        if (socketEventQueue.Get() != nullptr) {
-            SocketEvent socketEvent;
-            {
-                MutexGuard guard(socketEventQueue->_lock);
-                socketEvent = socketEventQueue->_list.front();
-                socketEventQueue->_list.pop_front();
+        SocketEventQueuePtr socketEventQueue = Dequeue(index);
+        if (socketEventQueue.Get() == nullptr) {
+            Park();
+            continue;
+        }
+
+        uint32_t quantumCount = _quantumCount.load(std::memory_order_relaxed);
+        uint32_t quantumTime  = _quantumTime.load(std::memory_order_relaxed);
+
+        /// take a quantum at once, one lock for all of them
+        std::list<SocketEvent> socketEvents;
+        {
+            MutexGuard guard(socketEventQueue->_lock);
+
+            auto last = socketEventQueue->_list.begin();
+            for (uint32_t i = 0; i < quantumCount && last != socketEventQueue->_list.end(); i++) {
+                ++last;
             }
+            socketEvents.splice(socketEvents.end(), socketEventQueue->_list, socketEventQueue->_list.begin(), last);
+        }
 
-            switch (socketEvent._type)
-            {
-            case Socket_Connect:
-                socketEvent._handler->OnStart(socketEvent._name, socketEvent._status);
-                socketEventQueue->_active++;
-                break;
-            case Socket_Receive:
-                socketEvent._handler->OnReceive(socketEvent._name, socketEvent._packet);
-                break;
-            case Socket_Close:
-                if (socketEvent._handler.Get()) {
-                    socketEvent._handler->OnClose(socketEvent._name);
-                    socketEventQueue->_active--;
-
-                    if (socketEventQueue->_active == 0) {
-                        MutexGuard guard(_eventQueueLock);
-                        if (socketEventQueue->_active == 0 && socketEventQueue->_list.empty()) {
-                            _socketHanlder2EventQueue.erase(socketEvent._handler);
-                        }
-                    }
-                } else {
-                    socketEvent._serverHandler->OnClose(socketEvent._name);
-                }
-                break;
-            default:
-                throw std::exception("Dispatcher::ThreadProc, Unknown EventType");
+        auto startTime = std::chrono::steady_clock::now();
+        while (!socketEvents.empty()) {
+            SocketEvent socketEvent = std::move(socketEvents.front());
+            socketEvents.pop_front();
+
+            Handle(socketEventQueue, socketEvent);
+
+            if (quantumTime != 0 && std::chrono::steady_clock::now() - startTime >= std::chrono::microseconds(quantumTime))
                 break;
-            }
-            Enqueue(socketEventQueue);
-        } else {
-            /// should use condition variable
-            Sleep(1);
         }
-    }
-}
 
-DWORD WINAPI Dispatcher::ThreadProc(LPVOID)
-{
-    theDispatcher.MainLoop();
-    return 0;
+        /// what the time slice left goes back in front, then to the own deque
+        /// while events are left, others may steal it
+        bool schedule;
+        {
+            MutexGuard guard(socketEventQueue->_lock);
+            socketEventQueue->_list.splice(socketEventQueue->_list.begin(), socketEvents);
+            schedule = !socketEventQueue->_list.empty();
+            socketEventQueue->_wait = schedule;
+        }
+
+        if (schedule) {
+            Schedule(socketEventQueue, index);
+        }
+    }
 }
 
 TINYNET_CLOSE()
\ No newline at end of file
@@ -8,10 +8,37 @@ enum SocketEventType
 {
     Socket_Connect,
     Socket_Receive,
+    Socket_Stream,
+    Socket_Backpressure,
+    Socket_WriteIdle,
     Socket_Close,
 };
 
 
+/// received events of one socket not handled yet, added by the io loop and
+/// taken away by the workers, see RecvLimit
+
+struct RecvWindow
+{
+    std::atomic<uint32_t>    _events;
+    std::atomic<uint32_t>    _bytes;
+
+    /// set by the io loop, UINT32_MAX while not limited
+    std::atomic<uint32_t>    _lowEvents;
+    std::atomic<uint32_t>    _lowBytes;
+
+    /// reads are not posted, whoever clears it resumes them
+    std::atomic<bool>        _paused;
+
+    bool UnderLow() const
+    {
+        return _events <= _lowEvents && _bytes <= _lowBytes;
+    }
+};
+
+typedef SharedPtr<RecvWindow> RecvWindowPtr;
+
+
 struct SocketEvent
 {
 public:
@@ -25,13 +52,43 @@ public:
         return se;
     }
 
-    static SocketEvent MakeReceive(SocketHandlerPtr& handler, uint32_t name, PacketPtr& packet)
+    static SocketEvent MakeReceive(SocketHandlerPtr& handler, uint32_t name, PacketPtr&& packet)
     {
         SocketEvent se;
         se._type = Socket_Receive;
         se._name = name;
         se._handler = handler;
-        se._packet  = packet;
+        se._packet  = std::move(packet);
+        return se;
+    }
+
+    static SocketEvent MakeStream(SocketHandlerPtr& handler, uint32_t name, PacketPtr&& packet, bool last)
+    {
+        SocketEvent se;
+        se._type = Socket_Stream;
+        se._name = name;
+        se._status  = last;
+        se._handler = handler;
+        se._packet  = std::move(packet);
+        return se;
+    }
+
+    static SocketEvent MakeBackpressure(SocketHandlerPtr& handler, uint32_t name, bool blocked)
+    {
+        SocketEvent se;
+        se._type = Socket_Backpressure;
+        se._name = name;
+        se._status  = blocked;
+        se._handler = handler;
+        return se;
+    }
+
+    static SocketEvent MakeWriteIdle(SocketHandlerPtr& handler, uint32_t name)
+    {
+        SocketEvent se;
+        se._type = Socket_WriteIdle;
+        se._name = name;
+        se._handler = handler;
         return se;
     }
 
@@ -56,9 +113,10 @@ public:
     SocketEventType     _type;
     uint32_t            _name;
 
-    bool                _status;  //for connect
+    bool                _status;  //for connect, last for stream, blocked for backpressure
 
-    PacketPtr           _packet;  //for receive
+    PacketPtr           _packet;  //for receive and stream
+    RecvWindowPtr       _window;  //for receive and stream of a limited socket
 
     SocketHandlerPtr    _handler;
     ServerHandlerPtr    _serverHandler;
@@ -67,18 +125,22 @@ public:
 
 struct SocketEventQueue
 {
-    bool                      _wait;    //Ƿڶ
-    bool                      _work;    //Ƿڴ
+    /// in a worker deque or being run, guarded by _lock
+    bool                      _wait;
     Mutex                     _lock;
     std::list<SocketEvent>    _list;
 
-    /// numbers of active sockets
-    uint32_t                  _active;
+    /// sockets which may still add events, guarded by _eventQueueLock of
+    /// the dispatcher
+    uint32_t                  _sockets;
 };
 
 typedef SharedPtr<SocketEventQueue> SocketEventQueuePtr;  
 
 
+/// a queue is only ever in one deque or run by one worker, events of a
+/// handler run in order and never at the same time
+
 class Dispatcher
 {
     NOCOPYASSIGN(Dispatcher);
@@ -89,28 +151,72 @@ public:
         return instance;
     }
 
-    Dispatcher() : _threadCount(0), _running(0)
+    Dispatcher() : _threadCount(0), _running(0), _quantumCount(64), _quantumTime(1000),
+        _next(0), _pending(0), _idle(0)
     {
-        for (int i = 0; i < 32; i++) {
-            _threads[i] = NULL;
-        }
     }
 
+    ~Dispatcher();
+
     void Start(uint32_t threadCount = 0);
     void Close();
 
+    /// the queue of the handler for a socket to keep until its last event,
+    /// Socket_Close or a failed Socket_Connect, is handled
+    SocketEventQueuePtr Attach(SocketHandlerPtr& handler);
+
+    /// events of a socket, only the lock of its queue is taken
+    void Enqueue(SocketEventQueuePtr& socketEventQueue, SocketEvent&& socketEvent);
+
+    /// events of listeners
     void Enqueue(SocketEvent&& socketEvent);
+
+    /// a worker runs at most count events or micros of one handler before
+    /// moving on to others, 0 micros for no time limit, may be called while
+    /// running and takes effect from the next quantum
+    void SetQuantum(uint32_t count, uint32_t micros);
 private:
-    void Enqueue(SocketEventQueuePtr& socketEventQueue, bool resetFlag = true);
-    SocketEventQueuePtr Dequeue();
+    /// push to the deque of worker index, waking a parked worker
+    void Schedule(SocketEventQueuePtr& socketEventQueue, uint32_t index);
 
-    static DWORD WINAPI ThreadProc(LPVOID);
+    /// own deque first, then steal from the others
+    SocketEventQueuePtr Dequeue(uint32_t index);
 
-    void MainLoop();
+    void Park();
+
+    void Handle(SocketEventQueuePtr& socketEventQueue, SocketEvent& socketEvent);
+
+    /// the last event of a socket was handled, the queue is erased with its
+    /// last socket so a handler never has two
+    void Detach(SocketEventQueuePtr& socketEventQueue, SocketHandlerPtr& handler);
+
+    void MainLoop(uint32_t index);
 private:
     uint32_t    _threadCount;
-    HANDLE      _threads[32];
     uint32_t    _running;
+
+    /// may be changed while workers run, read once for a quantum
+    std::atomic<uint32_t>    _quantumCount;
+    std::atomic<uint32_t>    _quantumTime;
+
+    std::vector<std::thread>    _threads;
+
+    struct Worker
+    {
+        Mutex                              _lock;
+        std::deque<SocketEventQueuePtr>    _queues;
+    };
+
+    std::vector<Worker*>     _workers;
+
+    /// round robin over workers for events from io threads
+    std::atomic<uint32_t>    _next;
+
+    /// queues sitting in deques, idle workers park while it is 0
+    std::atomic<uint32_t>    _pending;
+    std::atomic<uint32_t>    _idle;
+    std::mutex               _parkLock;
+    std::condition_variable  _parkCond;
     
     class SocketHandlerComparer
     {
@@ -121,14 +227,11 @@ private:
         }
     };
 
-    typedef std::list<SocketEventQueuePtr> SocketEventQueuePtrList;
     typedef std::map<SocketHandlerPtr, SocketEventQueuePtr, SocketHandlerComparer> SocketHandler2EventQueueMap;
 
-    /// should use condition variable
-
+    /// held from the lookup of a queue until its socket count is changed
     Mutex                          _eventQueueLock;
     SocketEventQueuePtr            _serverEventQueue;
-    SocketEventQueuePtrList        _socketEventQueueList;
     SocketHandler2EventQueueMap    _socketHanlder2EventQueue;
 };
 
@@ -0,0 +1,262 @@
+#pragma once
+#include "Require.h"
+
+#if defined(_WIN32)
+#include <mswsock.h>
+#else
+#if defined(TINYNET_IO_URING)
+#include <deque>
+#include <linux/io_uring.h>
+#else
+#include <sys/epoll.h>
+#endif
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef int SOCKET;
+
+#define INVALID_SOCKET  (-1)
+#define SOCKET_ERROR    (-1)
+#endif
+
+
+TINYNET_START()
+
+/// internal, platform layer under SocketManager
+
+/// every operation is completion based, a successful post always comes back
+/// from IoPort::Poll exactly once, failed if the socket was closed in between
+
+/// at most one receive side (accept, receive) and one send side (connect, send)
+/// operation can be outstanding on a socket
+
+enum IoOperation
+{
+    IoOp_Accept,
+    IoOp_Connect,
+    IoOp_Receive,
+    IoOp_Send,
+};
+
+
+/// Poll timeout blocking until something completes or Wake is called
+const uint32_t IoInfinite = UINT32_MAX;
+
+/// most pieces a gathered send takes at once
+const size_t IoGatherCount = 32;
+
+/// one piece of a gathered send
+struct IoBuffer
+{
+    const void*    _data;
+    size_t         _size;
+};
+
+
+class IoPort;
+
+#if defined(TINYNET_IO_URING)
+struct IoToken;
+
+/// received bytes parked in a ring buffer
+struct IoChunk
+{
+    uint16_t    _id;
+    uint32_t    _from;
+    uint32_t    _size;
+};
+#endif
+
+class IoSocket
+{
+    NOCOPYASSIGN(IoSocket);
+public:
+    IoSocket(SOCKET socket);
+    ~IoSocket();
+
+    static SOCKET Create();
+
+    bool Bind(IoPort* port);
+    bool Bind(const sockaddr_in& addr);
+    bool Listen();
+
+    /// accepted socket is left in _acceptSocket when succeeded
+    bool Accept();
+    bool Connect(const sockaddr_in& addr);
+    /// buffers are copied, the data has to stay until completion
+    bool Send(const IoBuffer* buffers, size_t count);
+    bool Receive(void* data, size_t size);
+
+    /// pending operations will fail
+    void Close();
+
+    SOCKET     _socket;
+    SOCKET     _acceptSocket;
+    IoPort*    _port;
+    bool       _closed;
+private:
+    friend class IoPort;
+
+#if defined(_WIN32)
+    IoOperation      _recvOperation;
+    IoOperation      _sendOperation;
+    WSABUF           _recvBuff;
+    WSABUF           _sendBuffs[IoGatherCount];
+    WSAOVERLAPPED    _sendOverlapped;
+    WSAOVERLAPPED    _recvOverlapped;
+    CHAR             _acceptBuffer[128];
+#elif defined(TINYNET_IO_URING)
+    /// shared with the kernel, outlives the socket while requests are in flight
+    IoToken*       _token;
+    bool           _ready;
+
+    bool           _recvPosted;
+    IoOperation    _recvOperation;
+    uint8_t*       _recvData;
+    size_t         _recvSize;
+
+    /// multishot accept or receive is armed
+    bool           _recvArmed;
+    bool           _recvStarved;
+    bool           _recvEnd;
+
+    /// multishot receive cancelled while nobody reads, see ParkCount
+    bool           _recvCancel;
+
+    /// completed by multishot but not posted for yet
+    std::deque<IoChunk>    _recvChunks;
+    std::deque<SOCKET>     _accepted;
+
+    bool           _sendPosted;
+    bool           _sendDone;
+    IoOperation    _sendOperation;
+    int32_t        _sendResult;
+    sockaddr_in    _connectAddr;
+    msghdr         _sendMsg;
+    iovec          _sendIov[IoGatherCount];
+#else
+    /// readiness reported by epoll, cleared when the operation would block
+    uint32_t       _events;
+    bool           _ready;
+
+    bool           _recvPosted;
+    IoOperation    _recvOperation;
+    uint8_t*       _recvData;
+    size_t         _recvSize;
+
+    bool           _sendPosted;
+    IoOperation    _sendOperation;
+    iovec          _sendIov[IoGatherCount];
+    size_t         _sendCount;
+    size_t         _sendSize;
+#endif
+};
+
+
+struct IoEvent
+{
+    IoSocket*      _socket;
+    IoOperation    _operation;
+    bool           _status;
+    uint32_t       _transfered;
+};
+
+
+class IoPort
+{
+    NOCOPYASSIGN(IoPort);
+public:
+    IoPort();
+    ~IoPort();
+
+    /// process wide setup of the socket library
+    static bool Initialize();
+    static void Finalize();
+
+    bool Open();
+    void Close();
+
+    /// wait at most timeout ms, return number of completed operations
+    size_t Poll(IoEvent* events, size_t count, uint32_t timeout);
+
+    /// make a blocking Poll return, callable from any thread
+    void Wake();
+private:
+    friend class IoSocket;
+
+#if defined(_WIN32)
+    HANDLE    _completion;
+
+    std::vector<OVERLAPPED_ENTRY>    _entries;
+#elif defined(TINYNET_IO_URING)
+    io_uring_sqe* GetSqe();
+
+    void Submit(uint32_t wait, uint32_t timeout);
+
+    void Complete(io_uring_cqe* cqe);
+
+    void Recycle(uint16_t id);
+
+    void Ready(IoSocket* socket);
+
+    bool Perform(IoSocket* socket, IoOperation operation, IoEvent& event);
+
+    bool Runnable(IoSocket* socket);
+
+    /// cancel a multishot receive nobody reads
+    void Disarm(IoSocket* socket);
+
+    void ArmWake();
+
+    int    _ring;
+    int    _wake;
+
+    /// submission and completion rings mapped from the kernel
+    void*       _sqRing;
+    size_t      _sqRingSize;
+    void*       _cqRing;
+    size_t      _cqRingSize;
+
+    io_uring_sqe*    _sqes;
+    size_t           _sqesSize;
+    unsigned*        _sqHead;
+    unsigned*        _sqTail;
+    unsigned         _sqMask;
+    unsigned         _sqEntries;
+    unsigned         _sqLocal;
+
+    io_uring_cqe*    _cqes;
+    unsigned*        _cqHead;
+    unsigned*        _cqTail;
+    unsigned         _cqMask;
+
+    /// provided buffers for multishot receive
+    io_uring_buf_ring*    _bufRing;
+    uint8_t*              _bufBase;
+    uint16_t              _bufTail;
+
+    std::vector<IoSocket*>    _ready;
+    std::vector<IoSocket*>    _doing;
+    std::vector<IoSocket*>    _starved;
+
+    /// tokens of destroyed sockets still waiting for the kernel
+    std::set<IoToken*>    _orphans;
+#else
+    void Ready(IoSocket* socket);
+
+    bool Perform(IoSocket* socket, IoOperation operation, IoEvent& event);
+
+    int    _epoll;
+    int    _wake;
+
+    /// sockets with a posted operation that can make progress
+    std::vector<IoSocket*>    _ready;
+    std::vector<IoSocket*>    _doing;
+
+    epoll_event    _events[256];
+#endif
+};
+
+TINYNET_CLOSE()
\ No newline at end of file
@@ -0,0 +1,365 @@
+#include "IoPort.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+
+
+TINYNET_START()
+
+/// edge triggered epoll made to look like a completion port, a posted
+/// operation is performed once epoll reports the socket ready for it
+
+namespace {
+
+const uint32_t RecvEvents = EPOLLIN  | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+const uint32_t SendEvents = EPOLLOUT | EPOLLERR | EPOLLHUP;
+
+inline bool WouldBlock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+}
+
+//////////////////////////////////////////////////////////////////////
+
+IoSocket::IoSocket(SOCKET socket) :
+    _socket(socket), _acceptSocket(INVALID_SOCKET), _port(nullptr), _closed(false),
+    _events(0), _ready(false),
+    _recvPosted(false), _recvOperation(IoOp_Receive), _recvData(nullptr), _recvSize(0),
+    _sendPosted(false), _sendOperation(IoOp_Send), _sendCount(0), _sendSize(0)
+{
+}
+
+IoSocket::~IoSocket()
+{
+    Close();
+
+    if (_acceptSocket != INVALID_SOCKET) {
+        close(_acceptSocket);
+    }
+}
+
+SOCKET IoSocket::Create()
+{
+    return ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+}
+
+bool IoSocket::Bind(IoPort* port)
+{
+    _port = port;
+
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = this;
+    return epoll_ctl(port->_epoll, EPOLL_CTL_ADD, _socket, &event) == 0;
+}
+
+bool IoSocket::Bind(const sockaddr_in& addr)
+{
+    /// restarted servers should not wait for TIME_WAIT to pass
+    int reuse = 1;
+    setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    return bind(_socket, (const sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+}
+
+bool IoSocket::Listen()
+{
+    return listen(_socket, 32) != SOCKET_ERROR;
+}
+
+bool IoSocket::Accept()
+{
+    if (_closed)
+        return false;
+
+    _recvOperation = IoOp_Accept;
+    _recvPosted = true;
+
+    if (_events & RecvEvents) { _port->Ready(this); }
+    return true;
+}
+
+bool IoSocket::Connect(const sockaddr_in& addr)
+{
+    if (_closed)
+        return false;
+
+    /// forget what was reported before connecting
+    _events &= ~SendEvents;
+
+    if (connect(_socket, (const sockaddr*)&addr, sizeof(addr)) == 0) {
+        _events |= EPOLLOUT;
+    } else if (errno != EINPROGRESS) {
+        return false;
+    }
+
+    _sendOperation = IoOp_Connect;
+    _sendPosted = true;
+
+    if (_events & SendEvents) { _port->Ready(this); }
+    return true;
+}
+
+bool IoSocket::Send(const IoBuffer* buffers, size_t count)
+{
+    if (_closed)
+        return false;
+
+    _sendCount = std::min(count, IoGatherCount);
+    _sendSize = 0;
+    for (size_t i = 0; i < _sendCount; i++) {
+        _sendIov[i].iov_base = (void*)buffers[i]._data;
+        _sendIov[i].iov_len = buffers[i]._size;
+        _sendSize += buffers[i]._size;
+    }
+
+    _sendOperation = IoOp_Send;
+    _sendPosted = true;
+
+    if (_events & SendEvents) { _port->Ready(this); }
+    return true;
+}
+
+bool IoSocket::Receive(void* data, size_t size)
+{
+    if (_closed)
+        return false;
+
+    _recvOperation = IoOp_Receive;
+    _recvData = (uint8_t*)data;
+    _recvSize = size;
+    _recvPosted = true;
+
+    if (_events & RecvEvents) { _port->Ready(this); }
+    return true;
+}
+
+void IoSocket::Close()
+{
+    if (!_closed) {
+        close(_socket);
+        _closed = true;
+
+        /// posted operations come back as failure
+        if (_recvPosted || _sendPosted) { _port->Ready(this); }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+IoPort::IoPort() : _epoll(-1), _wake(-1)
+{
+}
+
+IoPort::~IoPort()
+{
+    Close();
+}
+
+bool IoPort::Initialize()
+{
+    return true;
+}
+
+void IoPort::Finalize()
+{
+}
+
+bool IoPort::Open()
+{
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll == -1)
+        return false;
+
+    _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wake == -1)
+        return false;
+
+    /// the only registration without a socket behind it
+    epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = nullptr;
+    return epoll_ctl(_epoll, EPOLL_CTL_ADD, _wake, &event) == 0;
+}
+
+void IoPort::Close()
+{
+    if (_epoll != -1) {
+        close(_epoll);
+        _epoll = -1;
+    }
+
+    if (_wake != -1) {
+        close(_wake);
+        _wake = -1;
+    }
+}
+
+void IoPort::Wake()
+{
+    uint64_t value = 1;
+    ssize_t size = write(_wake, &value, sizeof(value));
+    (void)size;
+}
+
+void IoPort::Ready(IoSocket* socket)
+{
+    if (!socket->_ready) {
+        socket->_ready = true;
+        _ready.push_back(socket);
+    }
+}
+
+size_t IoPort::Poll(IoEvent* events, size_t count, uint32_t timeout)
+{
+    int waiting = !_ready.empty() ? 0 : timeout == IoInfinite ? -1 : (int)timeout;
+    int numOfEvents = epoll_wait(_epoll, _events, sizeof(_events) / sizeof(_events[0]), waiting);
+
+    for (int i = 0; i < numOfEvents; i++) {
+        IoSocket* socket = (IoSocket*)_events[i].data.ptr;
+        if (socket == nullptr) {
+            uint64_t value;
+            ssize_t size = read(_wake, &value, sizeof(value));
+            (void)size;
+            continue;
+        }
+
+        socket->_events |= _events[i].events;
+
+        if ((socket->_recvPosted && (socket->_events & RecvEvents)) ||
+            (socket->_sendPosted && (socket->_events & SendEvents))) {
+            Ready(socket);
+        }
+    }
+
+    size_t filled = 0;
+
+    _doing.swap(_ready);
+    for (auto socket : _doing) {
+        socket->_ready = false;
+
+        if (filled < count && socket->_recvPosted && Perform(socket, socket->_recvOperation, events[filled])) {
+            filled++;
+        }
+
+        if (filled < count && socket->_sendPosted && Perform(socket, socket->_sendOperation, events[filled])) {
+            filled++;
+        }
+
+        /// out of room, try again next time
+        if ((socket->_recvPosted && (socket->_closed || (socket->_events & RecvEvents))) ||
+            (socket->_sendPosted && (socket->_closed || (socket->_events & SendEvents)))) {
+            Ready(socket);
+        }
+    }
+    _doing.clear();
+
+    return filled;
+}
+
+bool IoPort::Perform(IoSocket* socket, IoOperation operation, IoEvent& event)
+{
+    event._socket = socket;
+    event._operation = operation;
+    event._status = false;
+    event._transfered = 0;
+
+    bool receive = operation == IoOp_Accept || operation == IoOp_Receive;
+    if (socket->_closed) {
+        if (receive) {
+            socket->_recvPosted = false;
+        } else {
+            socket->_sendPosted = false;
+        }
+        return true;
+    }
+
+    if (!(socket->_events & (receive ? RecvEvents : SendEvents)))
+        return false;
+
+    switch (operation)
+    {
+    case IoOp_Accept:
+        while (true) {
+            SOCKET accept = accept4(socket->_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (accept != INVALID_SOCKET) {
+                socket->_acceptSocket = accept;
+                event._status = true;
+                break;
+            }
+
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            if (WouldBlock()) {
+                socket->_events &= ~RecvEvents;
+                return false;
+            }
+            break;
+        }
+        socket->_recvPosted = false;
+        break;
+    case IoOp_Receive:
+        {
+            ssize_t size;
+            do {
+                size = recv(socket->_socket, socket->_recvData, socket->_recvSize, 0);
+            } while (size < 0 && errno == EINTR);
+
+            if (size < 0 && WouldBlock()) {
+                socket->_events &= ~RecvEvents;
+                return false;
+            }
+
+            /// short read drains the socket, next data arrival triggers again
+            if (size >= 0 && (size_t)size < socket->_recvSize) {
+                socket->_events &= ~EPOLLIN;
+            }
+
+            event._status = size > 0;
+            event._transfered = size > 0 ? (uint32_t)size : 0;
+            socket->_recvPosted = false;
+        }
+        break;
+    case IoOp_Connect:
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(socket->_socket, SOL_SOCKET, SO_ERROR, &error, &length) == 0) {
+                event._status = error == 0;
+            }
+            socket->_sendPosted = false;
+        }
+        break;
+    case IoOp_Send:
+        {
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = socket->_sendIov;
+            message.msg_iovlen = socket->_sendCount;
+
+            ssize_t size;
+            do {
+                size = sendmsg(socket->_socket, &message, MSG_NOSIGNAL);
+            } while (size < 0 && errno == EINTR);
+
+            if (size < 0 && WouldBlock()) {
+                socket->_events &= ~SendEvents;
+                return false;
+            }
+
+            if (size >= 0 && (size_t)size < socket->_sendSize) {
+                socket->_events &= ~EPOLLOUT;
+            }
+
+            event._status = size > 0;
+            event._transfered = size > 0 ? (uint32_t)size : 0;
+            socket->_sendPosted = false;
+        }
+        break;
+    }
+    return true;
+}
+
+TINYNET_CLOSE()
\ No newline at end of file
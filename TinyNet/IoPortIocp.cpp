@@ -0,0 +1,224 @@
+#include "IoPort.h"
+
+
+TINYNET_START()
+
+namespace {
+
+LPFN_ACCEPTEX  AcceptEx;
+LPFN_CONNECTEX ConnectEx;
+
+inline void ClearOverlapped(OVERLAPPED& overlapped)
+{
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+}
+
+inline bool Check(BOOL status)
+{
+    return status || WSAGetLastError() == ERROR_IO_PENDING;
+}
+
+}
+
+//////////////////////////////////////////////////////////////////////
+
+IoSocket::IoSocket(SOCKET socket) :
+    _socket(socket), _acceptSocket(INVALID_SOCKET), _port(nullptr), _closed(false)
+{
+}
+
+IoSocket::~IoSocket()
+{
+    Close();
+
+    if (_acceptSocket != INVALID_SOCKET) {
+        closesocket(_acceptSocket);
+    }
+}
+
+SOCKET IoSocket::Create()
+{
+    return WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+}
+
+bool IoSocket::Bind(IoPort* port)
+{
+    _port = port;
+
+    HANDLE fileHandle = (HANDLE)_socket;
+    return CreateIoCompletionPort(fileHandle, port->_completion, (ULONG_PTR)this, 0) != NULL;
+}
+
+bool IoSocket::Bind(const sockaddr_in& addr)
+{
+    return bind(_socket, (const sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+}
+
+bool IoSocket::Listen()
+{
+    return listen(_socket, 32) != SOCKET_ERROR;
+}
+
+bool IoSocket::Accept()
+{
+    _acceptSocket = Create();
+    if (_acceptSocket == INVALID_SOCKET)
+        return false;
+
+    _recvOperation = IoOp_Accept;
+    ClearOverlapped(_recvOverlapped);
+
+    DWORD size = sizeof(sockaddr_in) + 16;
+    if (!Check(AcceptEx(_socket, _acceptSocket, _acceptBuffer, 0, size, size, NULL, &_recvOverlapped))) {
+        closesocket(_acceptSocket);
+        _acceptSocket = INVALID_SOCKET;
+        return false;
+    }
+    return true;
+}
+
+bool IoSocket::Connect(const sockaddr_in& addr)
+{
+    _sendOperation = IoOp_Connect;
+    ClearOverlapped(_sendOverlapped);
+
+    return Check(ConnectEx(_socket, (const sockaddr*)&addr, sizeof(addr), NULL, 0, NULL, &_sendOverlapped));
+}
+
+bool IoSocket::Send(const IoBuffer* buffers, size_t count)
+{
+    count = std::min(count, IoGatherCount);
+    for (size_t i = 0; i < count; i++) {
+        _sendBuffs[i].buf = (CHAR*)buffers[i]._data;
+        _sendBuffs[i].len = (ULONG)buffers[i]._size;
+    }
+
+    _sendOperation = IoOp_Send;
+    ClearOverlapped(_sendOverlapped);
+
+    return Check(WSASend(_socket, _sendBuffs, (DWORD)count, NULL, 0, &_sendOverlapped, NULL) != SOCKET_ERROR);
+}
+
+bool IoSocket::Receive(void* data, size_t size)
+{
+    _recvBuff.buf = (CHAR*)data;
+    _recvBuff.len = size;
+
+    _recvOperation = IoOp_Receive;
+    ClearOverlapped(_recvOverlapped);
+
+    DWORD RecvBytes, Flags = 0;
+    return Check(WSARecv(_socket, &_recvBuff, 1, &RecvBytes, &Flags, &_recvOverlapped, NULL) != SOCKET_ERROR);
+}
+
+void IoSocket::Close()
+{
+    if (!_closed) {
+        closesocket(_socket);
+        _closed = true;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+IoPort::IoPort() : _completion(NULL)
+{
+}
+
+IoPort::~IoPort()
+{
+    Close();
+}
+
+bool IoPort::Initialize()
+{
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        return false;
+
+    if (LOBYTE(wsaData.wVersion) != 2 || HIBYTE(wsaData.wVersion) != 2)
+        return false;
+
+    SOCKET socket = IoSocket::Create();
+    if (socket == INVALID_SOCKET)
+        return false;
+
+    GUID acceptEx  = WSAID_ACCEPTEX;
+    GUID connectEx = WSAID_CONNECTEX;
+    DWORD byteRead = 0;
+    DWORD ctrlCode = SIO_GET_EXTENSION_FUNCTION_POINTER;
+    WSAIoctl(socket, ctrlCode, &acceptEx,  sizeof(GUID), &AcceptEx,  sizeof(AcceptEx),  &byteRead, 0, 0);
+    WSAIoctl(socket, ctrlCode, &connectEx, sizeof(GUID), &ConnectEx, sizeof(ConnectEx), &byteRead, 0, 0);
+    closesocket(socket);
+
+    return AcceptEx != NULL && ConnectEx != NULL;
+}
+
+void IoPort::Finalize()
+{
+    WSACleanup();
+}
+
+bool IoPort::Open()
+{
+    _completion = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+    return _completion != NULL;
+}
+
+void IoPort::Close()
+{
+    if (_completion != NULL) {
+        CloseHandle(_completion);
+        _completion = NULL;
+    }
+}
+
+void IoPort::Wake()
+{
+    /// comes back from GetQueuedCompletionStatus without an overlapped
+    PostQueuedCompletionStatus(_completion, 0, 0, NULL);
+}
+
+size_t IoPort::Poll(IoEvent* events, size_t count, uint32_t timeout)
+{
+    if (_entries.size() < count) {
+        _entries.resize(count);
+    }
+
+    ULONG removed = 0;
+    if (!GetQueuedCompletionStatusEx(_completion, _entries.data(), (ULONG)count, &removed, timeout, FALSE))
+        return 0;
+
+    size_t filled = 0;
+    for (ULONG i = 0; i < removed; i++) {
+        OVERLAPPED_ENTRY& entry = _entries[i];
+
+        /// posted by Wake
+        if (entry.lpOverlapped == nullptr)
+            continue;
+
+        IoSocket* socket = (IoSocket*)entry.lpCompletionKey;
+
+        /// Internal keeps the NTSTATUS of the finished operation
+        bool status = (LONG)entry.lpOverlapped->Internal >= 0;
+
+        IoEvent& event = events[filled++];
+        event._socket = socket;
+        event._status = status;
+        event._transfered = status ? entry.dwNumberOfBytesTransferred : 0;
+
+        if (entry.lpOverlapped == &socket->_recvOverlapped) {
+            event._operation = socket->_recvOperation;
+        } else {
+            event._operation = socket->_sendOperation;
+        }
+
+        if (event._operation == IoOp_Accept && !event._status) {
+            closesocket(socket->_acceptSocket);
+            socket->_acceptSocket = INVALID_SOCKET;
+        }
+    }
+    return filled;
+}
+
+TINYNET_CLOSE()
\ No newline at end of file
@@ -0,0 +1,747 @@
+#include "IoPort.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+
+TINYNET_START()
+
+/// io_uring port, accept and receive are multishot requests armed once, the
+/// received bytes land in a buffer ring shared by all sockets of the port and
+/// are copied out when a receive is posted
+
+/// sqes are only handed to the kernel in Poll, one io_uring_enter per loop
+/// both submits everything queued since and reaps the completions
+
+namespace {
+
+const unsigned RingEntries = 1024;
+const unsigned CompEntries = 8192;
+
+/// power of 2
+const unsigned BufferCount = 1024;
+const unsigned BufferSize  = 4096;
+const uint16_t BufferGroup = 0;
+
+/// ring buffers a socket may hold without a posted receive, a paused reader
+/// leaves the rest in the kernel instead of starving the other sockets
+const size_t ParkCount = 16;
+
+/// low bits of user_data, 0 is a request nobody waits for
+enum IoTag
+{
+    Tag_None,
+    Tag_Accept,
+    Tag_Receive,
+    Tag_Connect,
+    Tag_Send,
+    Tag_Wake,
+    Tag_Mask = 7,
+};
+
+inline int Setup(unsigned entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+inline int Enter(int ring, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t size)
+{
+    return (int)syscall(__NR_io_uring_enter, ring, submit, wait, flags, arg, size);
+}
+
+inline int Register(int ring, unsigned opcode, void* arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, ring, opcode, arg, count);
+}
+
+}
+
+struct IoToken
+{
+    IoSocket*    _socket;
+    uint32_t     _inflight;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+IoSocket::IoSocket(SOCKET socket) :
+    _socket(socket), _acceptSocket(INVALID_SOCKET), _port(nullptr), _closed(false),
+    _token(nullptr), _ready(false),
+    _recvPosted(false), _recvOperation(IoOp_Receive), _recvData(nullptr), _recvSize(0),
+    _recvArmed(false), _recvStarved(false), _recvEnd(false), _recvCancel(false),
+    _sendPosted(false), _sendDone(false), _sendOperation(IoOp_Send), _sendResult(0)
+{
+}
+
+IoSocket::~IoSocket()
+{
+    Close();
+
+    if (_acceptSocket != INVALID_SOCKET) {
+        close(_acceptSocket);
+    }
+
+    if (_port != nullptr) {
+        auto iter = std::find(_port->_starved.begin(), _port->_starved.end(), this);
+        if (iter != _port->_starved.end()) {
+            _port->_starved.erase(iter);
+        }
+    }
+
+    if (_token != nullptr) {
+        _token->_socket = nullptr;
+        if (_token->_inflight == 0) {
+            delete _token;
+        } else {
+            _port->_orphans.insert(_token);
+        }
+    }
+}
+
+SOCKET IoSocket::Create()
+{
+    return ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+}
+
+bool IoSocket::Bind(IoPort* port)
+{
+    _port = port;
+
+    _token = new IoToken;
+    _token->_socket = this;
+    _token->_inflight = 0;
+    return true;
+}
+
+bool IoSocket::Bind(const sockaddr_in& addr)
+{
+    /// restarted servers should not wait for TIME_WAIT to pass
+    int reuse = 1;
+    setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    return bind(_socket, (const sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+}
+
+bool IoSocket::Listen()
+{
+    return listen(_socket, 32) != SOCKET_ERROR;
+}
+
+bool IoSocket::Accept()
+{
+    if (_closed)
+        return false;
+
+    _recvOperation = IoOp_Accept;
+    _recvPosted = true;
+
+    _port->Ready(this);
+    return true;
+}
+
+bool IoSocket::Connect(const sockaddr_in& addr)
+{
+    if (_closed)
+        return false;
+
+    io_uring_sqe* sqe = _port->GetSqe();
+    if (sqe == nullptr)
+        return false;
+
+    _connectAddr = addr;
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = _socket;
+    sqe->addr = (uint64_t)&_connectAddr;
+    sqe->off = sizeof(_connectAddr);
+    sqe->user_data = (uint64_t)_token | Tag_Connect;
+
+    _token->_inflight++;
+    _sendOperation = IoOp_Connect;
+    _sendPosted = true;
+    _sendDone = false;
+    return true;
+}
+
+bool IoSocket::Send(const IoBuffer* buffers, size_t count)
+{
+    if (_closed)
+        return false;
+
+    io_uring_sqe* sqe = _port->GetSqe();
+    if (sqe == nullptr)
+        return false;
+
+    count = std::min(count, IoGatherCount);
+    if (count == 1) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)buffers[0]._data;
+        sqe->len = buffers[0]._size;
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            _sendIov[i].iov_base = (void*)buffers[i]._data;
+            _sendIov[i].iov_len = buffers[i]._size;
+        }
+
+        memset(&_sendMsg, 0, sizeof(_sendMsg));
+        _sendMsg.msg_iov = _sendIov;
+        _sendMsg.msg_iovlen = count;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t)&_sendMsg;
+        sqe->len = 1;
+    }
+    sqe->fd = _socket;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)_token | Tag_Send;
+
+    _token->_inflight++;
+    _sendOperation = IoOp_Send;
+    _sendPosted = true;
+    _sendDone = false;
+    return true;
+}
+
+bool IoSocket::Receive(void* data, size_t size)
+{
+    if (_closed)
+        return false;
+
+    _recvOperation = IoOp_Receive;
+    _recvData = (uint8_t*)data;
+    _recvSize = size;
+    _recvPosted = true;
+
+    _port->Ready(this);
+    return true;
+}
+
+void IoSocket::Close()
+{
+    if (!_closed) {
+        _closed = true;
+
+        /// cancel before the descriptor can be reused, connect and send
+        /// come back from the kernel, the rest is failed by the port
+        if (_token != nullptr && _token->_inflight > 0) {
+            io_uring_sqe* sqe = _port->GetSqe();
+            if (sqe != nullptr) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = _socket;
+                sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+                sqe->user_data = Tag_None;
+                _port->Submit(0, 0);
+            }
+        }
+        close(_socket);
+
+        for (auto& chunk : _recvChunks) {
+            _port->Recycle(chunk._id);
+        }
+        _recvChunks.clear();
+
+        for (auto accept : _accepted) {
+            close(accept);
+        }
+        _accepted.clear();
+
+        if (_recvPosted) { _port->Ready(this); }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+IoPort::IoPort() :
+    _ring(-1), _wake(-1), _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqes((io_uring_sqe*)MAP_FAILED),
+    _bufRing((io_uring_buf_ring*)MAP_FAILED), _bufBase(nullptr), _bufTail(0)
+{
+}
+
+IoPort::~IoPort()
+{
+    Close();
+}
+
+bool IoPort::Initialize()
+{
+    return true;
+}
+
+void IoPort::Finalize()
+{
+}
+
+bool IoPort::Open()
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = CompEntries;
+
+    _ring = Setup(RingEntries, &params);
+    if (_ring < 0)
+        return false;
+
+    /// multishot receive needs the kernel to stop on a full cq rather than drop
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG))
+        return false;
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    }
+
+    _sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED)
+        return false;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        _cqRing = _sqRing;
+    } else {
+        _cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED)
+            return false;
+    }
+
+    _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    _sqes = (io_uring_sqe*)mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED)
+        return false;
+
+    uint8_t* sq = (uint8_t*)_sqRing;
+    _sqHead    = (unsigned*)(sq + params.sq_off.head);
+    _sqTail    = (unsigned*)(sq + params.sq_off.tail);
+    _sqMask    = *(unsigned*)(sq + params.sq_off.ring_mask);
+    _sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    _sqLocal   = *_sqTail;
+
+    /// sqes are used in ring order, the indirection array never changes
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < _sqEntries; i++) {
+        array[i] = i;
+    }
+
+    uint8_t* cq = (uint8_t*)_cqRing;
+    _cqHead = (unsigned*)(cq + params.cq_off.head);
+    _cqTail = (unsigned*)(cq + params.cq_off.tail);
+    _cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    _cqes   = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    _bufRing = (io_uring_buf_ring*)mmap(NULL, BufferCount * sizeof(io_uring_buf),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_bufRing == MAP_FAILED)
+        return false;
+
+    _bufBase = (uint8_t*)malloc(BufferCount * BufferSize);
+    if (_bufBase == nullptr)
+        return false;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)_bufRing;
+    reg.ring_entries = BufferCount;
+    reg.bgid = BufferGroup;
+    if (Register(_ring, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        return false;
+
+    _bufTail = 0;
+    for (unsigned i = 0; i < BufferCount; i++) {
+        Recycle((uint16_t)i);
+    }
+
+    _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wake == -1)
+        return false;
+
+    ArmWake();
+    return true;
+}
+
+void IoPort::Close()
+{
+    if (_ring != -1) {
+        close(_ring);
+        _ring = -1;
+    }
+
+    if (_sqes != MAP_FAILED) {
+        munmap(_sqes, _sqesSize);
+        _sqes = (io_uring_sqe*)MAP_FAILED;
+    }
+
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing) {
+        munmap(_cqRing, _cqRingSize);
+    }
+    _cqRing = MAP_FAILED;
+
+    if (_sqRing != MAP_FAILED) {
+        munmap(_sqRing, _sqRingSize);
+        _sqRing = MAP_FAILED;
+    }
+
+    if (_bufRing != MAP_FAILED) {
+        munmap(_bufRing, BufferCount * sizeof(io_uring_buf));
+        _bufRing = (io_uring_buf_ring*)MAP_FAILED;
+    }
+
+    free(_bufBase);
+    _bufBase = nullptr;
+
+    if (_wake != -1) {
+        close(_wake);
+        _wake = -1;
+    }
+
+    for (auto token : _orphans) {
+        delete token;
+    }
+    _orphans.clear();
+}
+
+io_uring_sqe* IoPort::GetSqe()
+{
+    if (_sqLocal - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+        Submit(0, 0);
+
+        if (_sqLocal - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+            return nullptr;
+    }
+
+    io_uring_sqe* sqe = &_sqes[_sqLocal & _sqMask];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    _sqLocal++;
+    return sqe;
+}
+
+void IoPort::Wake()
+{
+    uint64_t value = 1;
+    ssize_t size = write(_wake, &value, sizeof(value));
+    (void)size;
+}
+
+void IoPort::ArmWake()
+{
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe != nullptr) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = _wake;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = Tag_Wake;
+    }
+}
+
+void IoPort::Submit(uint32_t wait, uint32_t timeout)
+{
+    __atomic_store_n(_sqTail, _sqLocal, __ATOMIC_RELEASE);
+    unsigned submit = _sqLocal - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+
+    __kernel_timespec ts;
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000;
+
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = timeout != IoInfinite ? (uint64_t)&ts : 0;
+
+    /// getevents also runs completions deferred to this thread
+    Enter(_ring, submit, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+void IoPort::Recycle(uint16_t id)
+{
+    /// bufs[] is not at offset 0 when the uapi header is compiled as c++
+    io_uring_buf* buf = (io_uring_buf*)_bufRing + (_bufTail & (BufferCount - 1));
+    buf->addr = (uint64_t)(_bufBase + (size_t)id * BufferSize);
+    buf->len  = BufferSize;
+    buf->bid  = id;
+
+    _bufTail++;
+    __atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+
+    /// buffers are back, receives that ran dry can be armed again
+    if (!_starved.empty()) {
+        for (auto socket : _starved) {
+            socket->_recvStarved = false;
+            if (socket->_recvPosted) { Ready(socket); }
+        }
+        _starved.clear();
+    }
+}
+
+void IoPort::Ready(IoSocket* socket)
+{
+    if (!socket->_ready) {
+        socket->_ready = true;
+        _ready.push_back(socket);
+    }
+}
+
+void IoPort::Complete(io_uring_cqe* cqe)
+{
+    if ((cqe->user_data & Tag_Mask) == Tag_None)
+        return;
+
+    if (cqe->user_data == Tag_Wake) {
+        uint64_t value;
+        ssize_t size = read(_wake, &value, sizeof(value));
+        (void)size;
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) { ArmWake(); }
+        return;
+    }
+
+    IoToken* token = (IoToken*)(cqe->user_data & ~(uint64_t)Tag_Mask);
+    IoTag tag = (IoTag)(cqe->user_data & Tag_Mask);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        token->_inflight--;
+    }
+
+    IoSocket* socket = token->_socket;
+    if (socket == nullptr) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            Recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+
+        if (tag == Tag_Accept && cqe->res >= 0) {
+            close(cqe->res);
+        }
+
+        if (token->_inflight == 0) {
+            _orphans.erase(token);
+            delete token;
+        }
+        return;
+    }
+
+    switch (tag)
+    {
+    case Tag_Accept:
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            socket->_recvArmed = false;
+        }
+
+        if (cqe->res >= 0) {
+            if (socket->_closed) {
+                close(cqe->res);
+            } else {
+                socket->_accepted.push_back(cqe->res);
+            }
+        } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            socket->_recvEnd = true;
+        }
+        break;
+    case Tag_Receive:
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            socket->_recvArmed = false;
+
+            /// not the end of the stream, armed again by the next post
+            if (socket->_recvCancel) {
+                socket->_recvCancel = false;
+                if (cqe->res == -ECANCELED)
+                    break;
+            }
+        }
+
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            IoChunk chunk;
+            chunk._id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            chunk._from = 0;
+            chunk._size = cqe->res;
+            if (socket->_closed) {
+                Recycle(chunk._id);
+            } else {
+                socket->_recvChunks.push_back(chunk);
+                if (!socket->_recvPosted && socket->_recvArmed && socket->_recvChunks.size() >= ParkCount) {
+                    Disarm(socket);
+                }
+            }
+        } else if (cqe->res == -ENOBUFS) {
+            if (!socket->_closed && !socket->_recvStarved) {
+                socket->_recvStarved = true;
+                _starved.push_back(socket);
+            }
+        } else if (cqe->res <= 0) {
+            socket->_recvEnd = true;
+        }
+        break;
+    case Tag_Connect:
+    case Tag_Send:
+        socket->_sendDone = true;
+        socket->_sendResult = cqe->res;
+        break;
+    default:
+        break;
+    }
+
+    if (Runnable(socket)) { Ready(socket); }
+}
+
+void IoPort::Disarm(IoSocket* socket)
+{
+    if (socket->_recvCancel)
+        return;
+
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe != nullptr) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)socket->_token | Tag_Receive;
+        sqe->user_data = Tag_None;
+        socket->_recvCancel = true;
+    }
+}
+
+bool IoPort::Runnable(IoSocket* socket)
+{
+    if (socket->_recvPosted) {
+        if (socket->_closed || socket->_recvEnd)
+            return true;
+
+        if (socket->_recvOperation == IoOp_Accept ? !socket->_accepted.empty() : !socket->_recvChunks.empty())
+            return true;
+
+        /// still has to be armed
+        if (!socket->_recvArmed && !socket->_recvStarved)
+            return true;
+    }
+
+    return socket->_sendPosted && socket->_sendDone;
+}
+
+size_t IoPort::Poll(IoEvent* events, size_t count, uint32_t timeout)
+{
+    bool idle = _ready.empty() && *_cqHead == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    Submit(idle ? 1 : 0, timeout);
+
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        Complete(&_cqes[head & _cqMask]);
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+
+    size_t filled = 0;
+
+    _doing.swap(_ready);
+    for (auto socket : _doing) {
+        socket->_ready = false;
+
+        if (filled < count && socket->_recvPosted && Perform(socket, socket->_recvOperation, events[filled])) {
+            filled++;
+        }
+
+        if (filled < count && socket->_sendPosted && Perform(socket, socket->_sendOperation, events[filled])) {
+            filled++;
+        }
+
+        /// out of room, try again next time
+        if (Runnable(socket)) { Ready(socket); }
+    }
+    _doing.clear();
+
+    return filled;
+}
+
+bool IoPort::Perform(IoSocket* socket, IoOperation operation, IoEvent& event)
+{
+    event._socket = socket;
+    event._operation = operation;
+    event._status = false;
+    event._transfered = 0;
+
+    switch (operation)
+    {
+    case IoOp_Accept:
+        if (socket->_closed) {
+            /// fail
+        } else if (!socket->_accepted.empty()) {
+            socket->_acceptSocket = socket->_accepted.front();
+            socket->_accepted.pop_front();
+            event._status = true;
+        } else if (socket->_recvEnd) {
+            /// report once, the next post arms again
+            socket->_recvEnd = false;
+        } else {
+            if (!socket->_recvArmed) {
+                io_uring_sqe* sqe = GetSqe();
+                if (sqe != nullptr) {
+                    sqe->opcode = IORING_OP_ACCEPT;
+                    sqe->fd = socket->_socket;
+                    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+                    sqe->accept_flags = SOCK_CLOEXEC;
+                    sqe->user_data = (uint64_t)socket->_token | Tag_Accept;
+
+                    socket->_token->_inflight++;
+                    socket->_recvArmed = true;
+                }
+            }
+            return false;
+        }
+        socket->_recvPosted = false;
+        return true;
+    case IoOp_Receive:
+        if (socket->_closed) {
+            /// fail
+        } else if (!socket->_recvChunks.empty()) {
+            size_t size = 0;
+            while (size < socket->_recvSize && !socket->_recvChunks.empty()) {
+                IoChunk& chunk = socket->_recvChunks.front();
+
+                size_t copy = std::min((size_t)chunk._size, socket->_recvSize - size);
+                memcpy(socket->_recvData + size, _bufBase + (size_t)chunk._id * BufferSize + chunk._from, copy);
+                size += copy;
+
+                chunk._from += copy;
+                chunk._size -= copy;
+                if (chunk._size == 0) {
+                    Recycle(chunk._id);
+                    socket->_recvChunks.pop_front();
+                }
+            }
+            event._status = true;
+            event._transfered = size;
+        } else if (socket->_recvEnd) {
+            /// eof or error
+        } else {
+            if (!socket->_recvArmed && !socket->_recvStarved) {
+                io_uring_sqe* sqe = GetSqe();
+                if (sqe != nullptr) {
+                    sqe->opcode = IORING_OP_RECV;
+                    sqe->fd = socket->_socket;
+                    sqe->ioprio = IORING_RECV_MULTISHOT;
+                    sqe->flags = IOSQE_BUFFER_SELECT;
+                    sqe->buf_group = BufferGroup;
+                    sqe->user_data = (uint64_t)socket->_token | Tag_Receive;
+
+                    socket->_token->_inflight++;
+                    socket->_recvArmed = true;
+                }
+            }
+            return false;
+        }
+        socket->_recvPosted = false;
+        return true;
+    case IoOp_Connect:
+    case IoOp_Send:
+        if (!socket->_sendDone)
+            return false;
+
+        if (operation == IoOp_Connect) {
+            event._status = socket->_sendResult == 0;
+        } else {
+            event._status = socket->_sendResult > 0;
+            event._transfered = socket->_sendResult > 0 ? socket->_sendResult : 0;
+        }
+
+        socket->_sendDone = false;
+        socket->_sendPosted = false;
+        return true;
+    }
+    return false;
+}
+
+TINYNET_CLOSE()
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "Packet.h"
 #include "Buffer.h"
+#include "Pool.h"
 
 
 TINYNET_START()
@@ -12,43 +13,54 @@ PacketPtr Packet::Create(size_t capacity)
         capacity = MaxCapacity;
     }
 
-    Packet* packet = (Packet*)malloc(sizeof(Packet) + capacity);
-    packet->_size = capacity;
+    /// whatever the size class gives is usable, growing by IncCapacity
+    /// in PacketWriter then mostly jumps a class
+    size_t size;
+    auto refer = RefCount_Pool<Packet>::Create(sizeof(Packet) + capacity, size);
+    Packet* packet = refer->Get();
+    packet->_size = (uint32_t)std::min(size - sizeof(Packet), (size_t)MaxCapacity);
     packet->_used = 0;
-    return PacketPtr(packet, free);
+    return PacketPtr::Adopt(refer);
 }
 
 namespace {
 
-Mutex __bufferContainersLock;
-std::map<Packet*, RefCount<Buffer>*> __bufferContainers;
-
-void Register(Packet* packet, RefCount<Buffer>* buffer)
+/// count of a packet viewing into a receive buffer, the reference to the
+/// buffer travels with the packet and is dropped with it
+class RefCount_View : public RefCount<Packet>
 {
-    buffer->IncRef();
-
-    MutexGuard guard(__bufferContainersLock);
-    __bufferContainers.insert(std::make_pair(packet, buffer));
-}
+public:
+    static RefCount_View* Create(Packet* packet, RefCount<Buffer>* buffer)
+    {
+        size_t capacity;
+        void* data = Pool::Alloc(sizeof(RefCount_View), capacity);
+        return new (data) RefCount_View(packet, buffer);
+    }
+protected:
+    RefCount_View(Packet* packet, RefCount<Buffer>* buffer)
+        : RefCount<Packet>(packet), _buffer(buffer)
+    {
+    }
 
-void UnRegister(Packet* packet)
-{
-    MutexGuard guard(__bufferContainersLock);
-    auto iter = __bufferContainers.find(packet);
-    if (iter != __bufferContainers.end()) {
-        iter->second->DecRef();
-        __bufferContainers.erase(iter);
+    void Destroy()
+    {
+        RefCount<Buffer>* buffer = _buffer;
+        this->~RefCount_View();
+        Pool::Free(this);
+        buffer->DecRef();
     }
-}
+
+    RefCount<Buffer>*    _buffer;
+};
 
 }
 
 PacketPtr Packet::Create(RefCount<Buffer>* buffer, uint8_t* from)
 {
     Packet* message = (Packet*)(from - 4);
-    Register(message, buffer);
+    buffer->IncRef();
 
-    return PacketPtr(message, UnRegister);
+    return PacketPtr::Adopt(RefCount_View::Create(message, buffer));
 }
 
 TINYNET_CLOSE()
\ No newline at end of file
@@ -18,12 +18,26 @@ public:
     static const size_t DefCapacity = 128;
     static const size_t IncCapacity = 128;
 
+    /// set in the wire length of every frame of a streamed message but the
+    /// last, receivers clear it before the packet is handed out
+    static const uint32_t MoreFlag = 0x80000000;
+
+    /// set in the wire length of a compressed frame, see Compressor
+    static const uint32_t PackFlag = 0x40000000;
+
+    /// set by StreamWriter on every frame and cleared before it is written,
+    /// SendLimit never drops a frame and nothing is sent between them
+    static const uint32_t StreamFlag = 0x20000000;
+
+    static const uint32_t FlagMask = MoreFlag | PackFlag | StreamFlag;
+
     static PacketPtr Create(size_t capacity = DefCapacity);
 
     static PacketPtr Create(RefCount<Buffer>* buffer, uint8_t* from);
 
-    size_t     _size;
-    size_t     _used;
+    /// fixed width so the 12 bytes wire header is the same on every platform
+    uint32_t   _size;
+    uint32_t   _used;
 
     int32_t    _type;
     int32_t    _guid;
@@ -72,11 +86,11 @@ public:
             _base = _last + val;
             break;
         default:
-            throw std::exception("PacketReader::Seek, Invalid SeekMode");
+            throw std::runtime_error("PacketReader::Seek, Invalid SeekMode");
         }
 
         if (_base < _data || _base > _last)
-            throw std::exception("PacketReader::Seek, Range Overflow");
+            throw std::runtime_error("PacketReader::Seek, Range Overflow");
 
         return _base - _data;
     }
@@ -84,7 +98,7 @@ public:
     void Read(void* data, size_t size)
     {
         if (_base + size > _last)
-            throw std::exception("PacketReader::Read, Range Overflow 0");
+            throw std::runtime_error("PacketReader::Read, Range Overflow 0");
 
         memcpy(data, _base, size);
         _base += size;
@@ -104,8 +118,7 @@ public:
     {
         static_assert(!std::is_pointer<T>::value && !std::is_reference<T>::value && std::is_pod<T>::value, "Invalid Type");
 
-        size_t size;
-        operator>>(size);
+        size_t size = ReadSize();
 
         arr.resize(size);
         Read(arr.data(), sizeof(T) * size);
@@ -121,11 +134,11 @@ public:
     template<class T>
     const T* ReadArray(size_t& size)
     {
-        operator>>(size);
+        size = ReadSize();
 
         const T* arr = (const T*)_base; 
         if (sizeof(T) * size + _base > _last)
-            throw std::exception("PacketReader::Read, Range Overflow 1");
+            throw std::runtime_error("PacketReader::Read, Range Overflow 1");
 
         _base += size * sizeof(T);
         return arr;
@@ -134,14 +147,14 @@ public:
     //UTF_8룬Cַ
     const char* ReadString(size_t& size)
     {
-        operator>>(size);
+        size = ReadSize();
 
         if (size + 1 + _base > _last)
-            throw std::exception("PacketReader::Read, Range Overflow 2");
+            throw std::runtime_error("PacketReader::Read, Range Overflow 2");
 
         const char* text = (const char*)_base;
         if (text[size] != 0)
-            throw std::exception("PacketReader::ReadString, Bad String");
+            throw std::runtime_error("PacketReader::ReadString, Bad String");
 
         _base += size + 1;
         return text;
@@ -153,6 +166,14 @@ public:
         return ReadString(size);
     }
 private:
+    /// lengths are 4 bytes on the wire whatever size_t is
+    size_t ReadSize()
+    {
+        uint32_t size;
+        operator>>(size);
+        return size;
+    }
+
     uint8_t*     _data;
     uint8_t*     _base;
     uint8_t*     _last;
@@ -184,7 +205,7 @@ public:
 
         if (_packet->_size < used) {
             if (used > Packet::MaxCapacity)
-                throw std::exception("PacketWriter::Write, Exceed MaxSize");    
+                throw std::runtime_error("PacketWriter::Write, Exceed MaxSize");    
 
             PacketPtr packet = Packet::Create(used + Packet::IncCapacity);
             memcpy(&packet->_used, &_packet->_used, _packet->_used + 12);
@@ -200,7 +221,7 @@ public:
 
     void Write(const char* text)
     {
-        int length = strlen(text);
+        uint32_t length = strlen(text);
         operator<<(length);
         Write(text, length + 1);
     }
@@ -219,14 +240,14 @@ public:
     {
         static_assert(!std::is_pointer<T>::value && !std::is_reference<T>::value && std::is_pod<T>::value, "Invalid Type");
 
-        operator<<(arr.size());
+        operator<<((uint32_t)arr.size());
         Write(arr.data(), arr.size() * sizeof(T));
         return *this;
     }
 
     PacketWriter& operator<<(const std::string& text)
     {
-        operator<<(text.size());
+        operator<<((uint32_t)text.size());
         Write(text.c_str(), text.size() + 1);
         return *this;
     }
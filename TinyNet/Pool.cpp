@@ -0,0 +1,231 @@
+#include "Pool.h"
+
+
+TINYNET_START()
+
+namespace {
+
+/// 64, 128, ... 32K
+const uint32_t ClassCount = 10;
+const uint32_t LargeClass = ClassCount;
+
+/// in front of every block, keeps the data 16 bytes aligned
+struct Block
+{
+    uint32_t    _class;
+    uint32_t    _reserved;
+    Block*      _next;
+};
+
+const size_t HeadSize = 16;
+static_assert(sizeof(Block) <= HeadSize, "Block header too large");
+
+inline size_t ClassSize(uint32_t index)
+{
+    return Pool::MinSize << index;
+}
+
+inline uint32_t ClassOf(size_t size)
+{
+    uint32_t index = 0;
+    while (index < ClassCount && ClassSize(index) < size) {
+        index++;
+    }
+    return index;
+}
+
+/// blocks moved between a thread and the central list at once
+inline uint32_t BatchOf(uint32_t index)
+{
+    size_t batch = 64 * 1024 / ClassSize(index);
+    return (uint32_t)std::max<size_t>(2, std::min<size_t>(64, batch));
+}
+
+struct Counter
+{
+    std::atomic<uint64_t>    _hits;
+    std::atomic<uint64_t>    _misses;
+    std::atomic<uint64_t>    _blocks;
+};
+
+struct Central
+{
+    Mutex       _lock[ClassCount];
+    Block*      _list[ClassCount];
+    Counter     _counter[ClassCount + 1];
+};
+
+/// never destroyed, blocks may still be freed by static destructors
+Central& GetCentral()
+{
+    static Central* central = new Central();
+    return *central;
+}
+
+/// plain thread local, still valid after the cache below is gone
+thread_local bool __cacheGone = false;
+
+struct ThreadCache
+{
+    Block*      _list[ClassCount];
+    uint32_t    _count[ClassCount];
+
+    /// not yet added to the central counters
+    uint64_t    _hits[ClassCount];
+
+    ThreadCache()
+    {
+        memset(this, 0, sizeof(ThreadCache));
+    }
+
+    ~ThreadCache()
+    {
+        for (uint32_t i = 0; i < ClassCount; i++) {
+            Release(i, _count[i]);
+        }
+        __cacheGone = true;
+    }
+
+    void Release(uint32_t index, uint32_t count)
+    {
+        Central& central = GetCentral();
+        central._counter[index]._hits += _hits[index];
+        _hits[index] = 0;
+
+        if (count == 0)
+            return;
+
+        Block* first = _list[index];
+        Block* last  = first;
+        for (uint32_t i = 1; i < count; i++) {
+            last = last->_next;
+        }
+        _list[index] = last->_next;
+        _count[index] -= count;
+
+        MutexGuard guard(central._lock[index]);
+        last->_next = central._list[index];
+        central._list[index] = first;
+    }
+
+    void Refill(uint32_t index)
+    {
+        Central& central = GetCentral();
+        central._counter[index]._hits += _hits[index];
+        central._counter[index]._misses++;
+        _hits[index] = 0;
+
+        uint32_t batch = BatchOf(index);
+        {
+            MutexGuard guard(central._lock[index]);
+            while (_count[index] < batch && central._list[index] != nullptr) {
+                Block* block = central._list[index];
+                central._list[index] = block->_next;
+
+                block->_next = _list[index];
+                _list[index] = block;
+                _count[index]++;
+            }
+        }
+
+        if (_count[index] == 0) {
+            Block* block = (Block*)malloc(HeadSize + ClassSize(index));
+            if (block == nullptr)
+                throw std::bad_alloc();
+
+            block->_class = index;
+            block->_next = nullptr;
+            _list[index] = block;
+            _count[index] = 1;
+            central._counter[index]._blocks++;
+        }
+    }
+};
+
+ThreadCache* GetCache()
+{
+    if (__cacheGone)
+        return nullptr;
+
+    static thread_local ThreadCache cache;
+    return &cache;
+}
+
+}
+
+void* Pool::Alloc(size_t size, size_t& capacity)
+{
+    uint32_t index = ClassOf(size);
+    ThreadCache* cache = index != LargeClass ? GetCache() : nullptr;
+
+    Block* block;
+    if (cache != nullptr) {
+        if (cache->_list[index] != nullptr) {
+            cache->_hits[index]++;
+        } else {
+            cache->Refill(index);
+        }
+
+        block = cache->_list[index];
+        cache->_list[index] = block->_next;
+        cache->_count[index]--;
+        capacity = ClassSize(index);
+    } else {
+        size_t bytes = index != LargeClass ? ClassSize(index) : size;
+        block = (Block*)malloc(HeadSize + bytes);
+        if (block == nullptr)
+            throw std::bad_alloc();
+
+        block->_class = index;
+        GetCentral()._counter[index]._blocks++;
+        capacity = bytes;
+    }
+    return (uint8_t*)block + HeadSize;
+}
+
+void Pool::Free(void* data)
+{
+    if (data == nullptr)
+        return;
+
+    Block* block = (Block*)((uint8_t*)data - HeadSize);
+    uint32_t index = block->_class;
+
+    ThreadCache* cache = index != LargeClass ? GetCache() : nullptr;
+    if (cache == nullptr) {
+        if (index == LargeClass) {
+            free(block);
+        } else {
+            Central& central = GetCentral();
+            MutexGuard guard(central._lock[index]);
+            block->_next = central._list[index];
+            central._list[index] = block;
+        }
+        return;
+    }
+
+    block->_next = cache->_list[index];
+    cache->_list[index] = block;
+    cache->_count[index]++;
+
+    /// producer threads keep freeing what consumers allocate, hand back the surplus
+    uint32_t batch = BatchOf(index);
+    if (cache->_count[index] > batch * 2) {
+        cache->Release(index, batch);
+    }
+}
+
+void Pool::GetStats(std::vector<PoolStats>& stats)
+{
+    Central& central = GetCentral();
+
+    stats.resize(ClassCount + 1);
+    for (uint32_t i = 0; i <= ClassCount; i++) {
+        stats[i]._size   = i != LargeClass ? ClassSize(i) : 0;
+        stats[i]._hits   = central._counter[i]._hits;
+        stats[i]._misses = central._counter[i]._misses;
+        stats[i]._blocks = central._counter[i]._blocks;
+    }
+}
+
+TINYNET_CLOSE()
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+#include "RefCount.h"
+
+
+TINYNET_START()
+
+/// counters of one size class, the last entry of Pool::GetStats is for
+/// blocks larger than every class and has _size 0
+
+struct PoolStats
+{
+    size_t      _size;
+
+    /// served by the cache of the calling thread
+    uint64_t    _hits;
+
+    /// the thread cache had to be refilled
+    uint64_t    _misses;
+
+    /// blocks taken from malloc
+    uint64_t    _blocks;
+};
+
+
+/// size classed blocks from 64 bytes to 32K, cached per thread, a block can
+/// be freed by any thread and goes to the cache of that thread
+
+class Pool
+{
+public:
+    static const size_t MinSize = 64;
+    static const size_t MaxSize = 32 * 1024;
+
+    /// capacity is the usable size of the block, at least size
+    static void* Alloc(size_t size, size_t& capacity);
+
+    static void Free(void* data);
+
+    /// counters of other threads show up after their next refill or release
+    static void GetStats(std::vector<PoolStats>& stats);
+};
+
+
+/// count and object in one pool block, the object follows the count and
+/// is left to the caller to construct, it must not need destruction
+
+template<class T>
+class RefCount_Pool : public RefCount<T>
+{
+public:
+    /// capacity is what the block has left for the object, at least size
+    static RefCount_Pool* Create(size_t size, size_t& capacity)
+    {
+        const size_t head = (sizeof(RefCount_Pool) + 15) & ~(size_t)15;
+
+        uint8_t* data = (uint8_t*)Pool::Alloc(head + size, capacity);
+        capacity -= head;
+        return new (data) RefCount_Pool((T*)(data + head));
+    }
+protected:
+    RefCount_Pool(T* ptr) : RefCount<T>(ptr)
+    {
+    }
+
+    void Destroy()
+    {
+        this->~RefCount_Pool();
+        Pool::Free(this);
+    }
+};
+
+TINYNET_CLOSE()
\ No newline at end of file
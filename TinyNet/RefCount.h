@@ -9,7 +9,7 @@ class RefCount
 {
     NOCOPYASSIGN(RefCount);
 public:
-    RefCount(T* ptr) : _ref(1), _ptr(ptr)
+    RefCount(T* ptr) : _ref(1), _ptr(ptr), _atomic(true)
     {
     }
 
@@ -34,20 +34,34 @@ public:
 
     uint32_t IncRef()
     {
-        return InterlockedIncrement(&_ref);
+        return _atomic ? InterlockedIncrement(&_ref) : ++_ref;
     }
 
     uint32_t DecRef()
     {
-        uint32_t ref = InterlockedDecrement(&_ref);
+        uint32_t ref = _atomic ? InterlockedDecrement(&_ref) : --_ref;
         if (ref == 0) { Destroy(); }
         return ref;
     }
+
+    /// with a full barrier, nobody but the caller holding owned references
+    /// has one when true
+    bool IsUnique(uint32_t owned = 1)
+    {
+        return _atomic ? InterlockedCompareExchange(&_ref, owned, owned) == owned : _ref == owned;
+    }
+
+    /// only when every reference is taken and dropped by one thread at a time
+    void SetLocal()
+    {
+        _atomic = false;
+    }
 protected:
     virtual void Destroy() = 0;
 
     T*          _ptr;
     uint32_t    _ref;
+    bool        _atomic;
 };
 
 
@@ -55,13 +69,13 @@ template<class T>
 class RefCount_Default : public RefCount<T>
 {
 public:
-    RefCount_Default(T* ptr) : RefCount(ptr)
+    RefCount_Default(T* ptr) : RefCount<T>(ptr)
     {
     }
 protected:
     void Destroy()
     {
-        delete _ptr;
+        delete this->_ptr;
         delete this;
     }
 };
@@ -71,13 +85,13 @@ template<class T, class D>
 class RefCount_Deleter : public RefCount<T>
 {
 public:
-    RefCount_Deleter(T* ptr, const D& del) : RefCount(ptr), _del(del)
+    RefCount_Deleter(T* ptr, const D& del) : RefCount<T>(ptr), _del(del)
     {
     }
 protected:
     void Destroy()
     {
-        _del(_ptr);
+        _del(this->_ptr);
         delete this;
     }
 
@@ -85,16 +99,37 @@ protected:
 };
 
 
+/// object and count in one allocation
 template<class T>
-RefCount<T>* MakeShared(T* ptr)
+class RefCount_Inplace : public RefCount<T>
+{
+public:
+    template<class... Args>
+    RefCount_Inplace(Args&&... args) : RefCount<T>(nullptr)
+    {
+        this->_ptr = new (&_storage) T(std::forward<Args>(args)...);
+    }
+protected:
+    void Destroy()
+    {
+        this->_ptr->~T();
+        delete this;
+    }
+
+    typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type    _storage;
+};
+
+
+template<class T>
+RefCount<T>* MakeRefCount(T* ptr)
 {
     return new RefCount_Default<T>(ptr);
 }
 
 template<class T, class D>
-RefCount<T>* MakeShared(T* ptr, const D& d)
+RefCount<T>* MakeRefCount(T* ptr, const D& d)
 {
-    return new RefCount_Deleter<T, decltype(d)>(ptr, d);
+    return new RefCount_Deleter<T, typename std::decay<D>::type>(ptr, d);
 }
 
 
@@ -103,16 +138,25 @@ class SharedPtr
 {
 public:
     SharedPtr(T* ptr = nullptr) : _ptr(ptr),
-        _ref(ptr == nullptr ? nullptr : MakeShared(ptr))
+        _ref(ptr == nullptr ? nullptr : MakeRefCount(ptr))
     {
     }
 
     template<class D>
     SharedPtr(T* ptr, const D& del) : _ptr(ptr),
-        _ref(ptr == nullptr ? nullptr : MakeShared(ptr, del))
+        _ref(ptr == nullptr ? nullptr : MakeRefCount(ptr, del))
     {
     }
 
+    /// takes over the reference held by refer
+    static SharedPtr Adopt(RefCount<T>* refer)
+    {
+        SharedPtr ptr;
+        ptr._ptr = refer->Get();
+        ptr._ref = refer;
+        return ptr;
+    }
+
     SharedPtr(SharedPtr&& rhs)
     {
         _ptr = rhs._ptr;
@@ -214,4 +258,12 @@ private:
     RefCount<T>*   _ref;
 };
 
+
+/// single allocation, SharedPtr<T>(new T(...)) allocates twice
+template<class T, class... Args>
+SharedPtr<T> MakeShared(Args&&... args)
+{
+    return SharedPtr<T>::Adopt(new RefCount_Inplace<T>(std::forward<Args>(args)...));
+}
+
 TINYNET_CLOSE()
\ No newline at end of file
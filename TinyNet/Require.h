@@ -2,18 +2,37 @@
 #include <set>
 #include <map>
 #include <list>
+#include <deque>
 #include <vector>
 #include <memory>
 #include <string>
+#include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <type_traits>
 #include <algorithm>
 #include <queue>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <stdexcept>
 #include <condition_variable>
 
+#if defined(_WIN32)
+/// keep std::min and std::max usable
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
 #include <winsock2.h>
 #include <windows.h>
 #pragma comment(lib, "ws2_32.lib")
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
 
 
 #define NOCOPYASSIGN(clazz)         \
@@ -24,8 +43,44 @@
 #define TINYNET_CLOSE() }
 
 
+#if !defined(_WIN32)
+
+/// the few win32 calls shared by all platforms
+
+inline uint32_t InterlockedIncrement(volatile uint32_t* addend)
+{
+    return __sync_add_and_fetch(addend, 1);
+}
+
+inline uint32_t InterlockedDecrement(volatile uint32_t* addend)
+{
+    return __sync_sub_and_fetch(addend, 1);
+}
+
+inline uint32_t InterlockedCompareExchange(volatile uint32_t* dest, uint32_t exchange, uint32_t comparand)
+{
+    return __sync_val_compare_and_swap(dest, comparand, exchange);
+}
+
+inline uint32_t GetTickCount()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+inline void Sleep(uint32_t milliseconds)
+{
+    usleep(milliseconds * 1000);
+}
+
+#endif
+
+
 TINYNET_START()
 
+#if defined(_WIN32)
+
 class Mutex
 {
     NOCOPYASSIGN(Mutex);
@@ -53,6 +108,33 @@ private:
     CRITICAL_SECTION _mutex;
 };
 
+#else
+
+/// recursive like CRITICAL_SECTION
+
+class Mutex
+{
+    NOCOPYASSIGN(Mutex);
+public:
+    Mutex()
+    {
+    }
+
+    void Enter()
+    {
+        _mutex.lock();
+    }
+
+    void Leave()
+    {
+        _mutex.unlock();
+    }
+private:
+    std::recursive_mutex _mutex;
+};
+
+#endif
+
 class MutexGuard
 {
     NOCOPYASSIGN(MutexGuard);
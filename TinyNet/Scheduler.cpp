@@ -3,129 +3,428 @@
 
 TINYNET_START()
 
-void Scheduler::Start()
+Scheduler::Scheduler() : _running(0), _count(0), _tick(0), _now(0), _coarse(false), _waiting(false),
+    _waitUntil(0), _doneWaiters(0)
+{
+    for (uint32_t i = 0; i < NearSize; i++) {
+        Init(_near[i]);
+    }
+
+    for (uint32_t level = 0; level < FarLevel; level++) {
+        for (uint32_t i = 0; i < FarSize; i++) {
+            Init(_far[level][i]);
+        }
+    }
+    Init(_expired);
+
+    memset(&_stats, 0, sizeof(_stats));
+    _base = std::chrono::steady_clock::now();
+}
+
+Scheduler::~Scheduler()
+{
+    Close();
+
+    for (auto timer : _timers) {
+        delete timer;
+    }
+}
+
+void Scheduler::Start(uint32_t workers)
 {
     if (InterlockedCompareExchange(&_running, 1, 0) == 0) {
-        _thread = CreateThread(NULL, 0, &Scheduler::ThreadProc, NULL, 0, NULL);
-        if (_thread == NULL)
-            throw std::exception("Scheduler::Start, 1");
+        for (uint32_t i = 0; i < workers; i++) {
+            _workers.push_back(std::thread(&Scheduler::WorkLoop, this));
+        }
+        _thread = std::thread(&Scheduler::MainLoop, this);
     }
 }
 
 void Scheduler::Close()
 {
-    if (InterlockedCompareExchange(&_running, 0, 1) == 1 && _thread != NULL) {
+    if (InterlockedCompareExchange(&_running, 0, 1) == 1 && _thread.joinable()) {
         {
             LockGuard guard(_timerLock);
             _condition.notify_one();
+            _workCondition.notify_all();
         }
 
-        WaitForSingleObject(_thread, INFINITE);
-        CloseHandle(_thread);
-        _thread = NULL;
-    }
-}
+        _thread.join();
 
-DWORD Scheduler::ThreadProc(LPVOID)
-{
-    theScheduler.MainLoop();
-    return 0;
+        for (auto& worker : _workers) {
+            worker.join();
+        }
+        _workers.clear();
+    }
 }
 
 void Scheduler::MainLoop()
 {
-    while (true) {
-        /// try to acquire next timer
-        TimerPtr timer;
-        while (_running) {
-            LockGuard guard(_timerLock);
+    LockGuard guard(_timerLock);
+    while (_running) {
+        /// due timers are taken in bulk, the clock is read once for all of them
+        if (_workers.empty() && _expired._next != &_expired) {
+            Run(guard);
+            continue;
+        }
 
-            uint32_t curTime = GetTickCount();
-            uint32_t dueTime = curTime + 1000;
-            if (_timerQueue.size() > 0) {
-                /// erase retired timer
-                TimerPtr topper = _timerQueue.top();
-                if (topper->_retired) {
-                    _timerQueue.pop();
-                    continue;
-                }
+        uint64_t now = Now();
+        Advance(now);
 
-                dueTime = topper->_dueTime;
-                if (dueTime <= curTime) {
-                    timer = topper;
-                    timer->_running = true;
-                    _timerQueue.pop();
-                    break;
-                }
-            }
+        if (_expired._next != &_expired) {
+            if (_workers.empty())
+                continue;
 
-            std::chrono::duration<int, std::milli> elapsed(dueTime - curTime);
-            _condition.wait_for(guard, elapsed);
+            _workCondition.notify_all();
         }
 
-        if (!_running) break;
+        _waiting = true;
+        _waitUntil = NextWait(now);
+        _condition.wait_until(guard, _base + std::chrono::microseconds(_waitUntil));
+        _waiting = false;
+    }
+}
 
-        try
-        {
-            /// run timer
-            timer->_action();
-        }
-        catch(...)
-        {
+void Scheduler::WorkLoop()
+{
+    LockGuard guard(_timerLock);
+    while (_running) {
+        if (_expired._next == &_expired) {
+            _workCondition.wait(guard);
+            continue;
         }
+        Run(guard);
+    }
+}
 
-        timer->_running = false;
+void Scheduler::Run(LockGuard& guard)
+{
+    Timer* timer = (Timer*)_expired._next;
+    Unlink(timer);
 
-        LockGuard guard(_timerLock);
-        if (timer->_period == 0) {
-            _timerMap.erase(timer->_name);
-        } else {
-            /// retired timer will be erased later
-            timer->_dueTime += timer->_period;
-            _timerQueue.push(timer);
+    uint64_t now = _coarse ? _now : Now();
+    uint64_t late = now > timer->_dueTime ? now - timer->_dueTime : 0;
+    _stats._runs++;
+    _stats._lateTotal += late;
+    _stats._lateMax = std::max(_stats._lateMax, (uint32_t)std::min<uint64_t>(late, UINT32_MAX));
+
+    timer->_running = true;
+    timer->_runner = std::this_thread::get_id();
+    guard.unlock();
+
+    try
+    {
+        /// run timer
+        timer->_action();
+    }
+    catch(...)
+    {
+    }
+
+    guard.lock();
+    timer->_running = false;
+
+    if (_doneWaiters > 0) {
+        _doneCondition.notify_all();
+    }
+
+    if (timer->_period == 0 || timer->_retired) {
+        /// both may take locks of their own, or schedule again
+        std::function<void()> action;
+        std::function<void()> done;
+        action.swap(timer->_action);
+        done.swap(timer->_done);
+        Release(timer);
+
+        guard.unlock();
+        action = nullptr;
+        if (done) {
+            done();
+        }
+        guard.lock();
+        return;
+    }
+
+    timer->_dueTime += timer->_period;
+    if (timer->_policy == Timer_Skip) {
+        now = _coarse ? _now : Now();
+        if (timer->_dueTime <= now) {
+            uint64_t skips = (now - timer->_dueTime) / timer->_period + 1;
+            timer->_dueTime += skips * timer->_period;
+            _stats._skips += skips;
         }
     }
+    Add(timer);
+
+    /// workers add timers behind the back of the loop
+    if (_waiting && timer->_dueTime < _waitUntil) {
+        _condition.notify_one();
+    }
 }
 
-uint32_t Scheduler::Schedule(const std::function<void()>& func, uint32_t delay, uint32_t period)
+uint32_t Scheduler::Schedule(const std::function<void()>& func, uint32_t delay, uint32_t period, TimerPolicy policy)
 {
-    TimerPtr timer(new Timer);
+    return Schedule(func, std::chrono::milliseconds(delay), std::chrono::milliseconds(period), policy);
+}
+
+uint32_t Scheduler::Schedule(const std::function<void()>& func, std::chrono::microseconds delay,
+    std::chrono::microseconds period, TimerPolicy policy)
+{
+    LockGuard guard(_timerLock);
+
+    Timer* timer = Acquire();
     timer->_action  = func;
-    timer->_period  = period;
+    timer->_period  = std::max<int64_t>(period.count(), 0);
+    timer->_policy  = policy;
     timer->_running = false;
     timer->_retired = false;
-    timer->_dueTime = GetTickCount() + delay;
+    /// the read of a waiting loop is as old as the wait
+    uint64_t now = _coarse && !_waiting ? _now : Now();
+    timer->_dueTime = now + std::max<int64_t>(delay.count(), 0);
+    Add(timer);
 
-    uint32_t name = InterlockedIncrement(&_timerNext);
-    timer->_name = name;
+    if (_waiting && timer->_dueTime < _waitUntil) {
+        _condition.notify_one();
+    }
+    return timer->_name;
+}
+
+void Scheduler::ShutDown(uint32_t name)
+{
+    /// destroyed after the lock is released
+    std::function<void()> action;
 
     LockGuard guard(_timerLock);
-    _timerMap.emplace(name, timer);
-    _timerQueue.push(timer);
 
-    /// always wake up mainloop in case timer will run imediately
-    _condition.notify_one();
-    return name;
+    Timer* timer = Find(name);
+    if (timer == nullptr)
+        return;
+
+    /// waiting in the wheel
+    if (!timer->_running) {
+        action.swap(timer->_action);
+        Unlink(timer);
+        Release(timer);
+        return;
+    }
+
+    /// released by the thread running it when done
+    timer->_retired = true;
+
+    /// in case shutdown is running in timer callback which causes deadlock
+    if (std::this_thread::get_id() == timer->_runner)
+        return;
+
+    /// a released node gets a new name
+    _doneWaiters++;
+    while (timer->_name == name && timer->_running) {
+        _doneCondition.wait(guard);
+    }
+    _doneWaiters--;
 }
 
-void Scheduler::ShutDown(uint32_t name)
+bool Scheduler::Cancel(uint32_t name, const std::function<void()>& done)
+{
+    std::function<void()> action;
+    {
+        LockGuard guard(_timerLock);
+
+        Timer* timer = Find(name);
+        if (timer == nullptr)
+            return false;
+
+        if (timer->_running) {
+            timer->_retired = true;
+            if (done) {
+                if (timer->_done) {
+                    std::function<void()> first = std::move(timer->_done);
+                    timer->_done = [first, done] { first(); done(); };
+                } else {
+                    timer->_done = done;
+                }
+            }
+            return true;
+        }
+
+        action.swap(timer->_action);
+        Unlink(timer);
+        Release(timer);
+    }
+
+    if (done) {
+        done();
+    }
+    return true;
+}
+
+SchedulerStats Scheduler::GetStats()
 {
     LockGuard guard(_timerLock);
+    return _stats;
+}
+
+void Scheduler::SetCoarseClock(bool coarse)
+{
+    LockGuard guard(_timerLock);
+    _coarse = coarse;
+}
+
+uint64_t Scheduler::Now()
+{
+    /// 64 bits of us, no wrap in practice
+    auto elapsed = std::chrono::steady_clock::now() - _base;
+    _now = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    return _now;
+}
+
+Scheduler::Timer* Scheduler::Find(uint32_t name)
+{
+    uint32_t index = name & IndexMask;
+    if (index >= _timers.size() || _timers[index]->_name != name)
+        return nullptr;
+
+    return _timers[index];
+}
+
+Scheduler::Timer* Scheduler::Acquire()
+{
+    Timer* timer;
+    if (!_free.empty()) {
+        timer = _timers[_free.back()];
+        _free.pop_back();
+    } else {
+        if (_timers.size() > IndexMask)
+            throw std::runtime_error("Scheduler::Schedule, Too Many Timers");
+
+        timer = new Timer;
+        timer->_name = (uint32_t)_timers.size() + IndexMask + 1;
+        _timers.push_back(timer);
+    }
 
-    auto iter = _timerMap.find(name);
-    if (iter != _timerMap.end()) {
-        iter->second->_retired = true;
+    _count++;
+    return timer;
+}
 
-        /// should use spin-wait
-        while (iter->second->_running) {
-            
-            /// in case shutdown is running in timer callback which causes deadlock
-            if (GetCurrentThreadId() == GetThreadId(_thread))
-                return;
+void Scheduler::Release(Timer* timer)
+{
+    timer->_action = nullptr;
 
-            ::Sleep(1);
+    /// next generation, the old name is gone, a name is never 0
+    timer->_name += IndexMask + 1;
+    if ((timer->_name >> IndexBits) == 0) {
+        timer->_name += IndexMask + 1;
+    }
+
+    _free.push_back(timer->_name & IndexMask);
+    _count--;
+}
+
+void Scheduler::Add(Timer* timer)
+{
+    /// the tick at or after the due time
+    uint64_t dueTime = std::max((timer->_dueTime + TickSize - 1) / TickSize, _tick);
+    uint64_t delta = dueTime - _tick;
+
+    if (delta < NearSize) {
+        Link(_near[dueTime & (NearSize - 1)], timer);
+        return;
+    }
+
+    uint32_t level = 0;
+    while (level + 1 < FarLevel && delta >= (uint64_t)1 << (NearBits + (level + 1) * FarBits)) {
+        level++;
+    }
+
+    uint64_t range = (uint64_t)1 << (NearBits + FarLevel * FarBits);
+    if (delta >= range) {
+        dueTime = _tick + range - 1;
+    }
+
+    uint32_t shift = NearBits + level * FarBits;
+    Link(_far[level][(dueTime >> shift) & (FarSize - 1)], timer);
+}
+
+void Scheduler::Advance(uint64_t now)
+{
+    now /= TickSize;
+    if (_count == 0) {
+        _tick = std::max(_tick, now + 1);
+        return;
+    }
+
+    while (_tick <= now) {
+        uint32_t index = (uint32_t)(_tick & (NearSize - 1));
+
+        /// the next slot of each level down is spread over the one below
+        if (index == 0) {
+            for (uint32_t level = 0; level < FarLevel; level++) {
+                uint32_t slot = (uint32_t)(_tick >> (NearBits + level * FarBits)) & (FarSize - 1);
+
+                TimerLink& list = _far[level][slot];
+                while (list._next != &list) {
+                    Timer* timer = (Timer*)list._next;
+                    Unlink(timer);
+                    Add(timer);
+                }
+
+                if (slot != 0)
+                    break;
+            }
         }
+
+        TimerLink& list = _near[index];
+        if (list._next != &list) {
+            TimerLink* first = list._next;
+            TimerLink* last  = list._prev;
+            Init(list);
+
+            first->_prev = _expired._prev;
+            _expired._prev->_next = first;
+            last->_next = &_expired;
+            _expired._prev = last;
+        }
+        _tick++;
     }
 }
 
+uint64_t Scheduler::NextWait(uint64_t now)
+{
+    if (_count == 0)
+        return now + 1000000;
+
+    /// a cascade is due at the very next tick
+    uint32_t index = (uint32_t)(_tick & (NearSize - 1));
+    uint32_t ticks = index != 0 ? NearSize - index : 0;
+    for (uint32_t i = 0; i < ticks; i++) {
+        if (_near[index + i]._next != &_near[index + i]) {
+            ticks = i;
+            break;
+        }
+    }
+
+    return (_tick + ticks) * TickSize;
+}
+
+void Scheduler::Init(TimerLink& list)
+{
+    list._prev = &list;
+    list._next = &list;
+}
+
+void Scheduler::Link(TimerLink& list, TimerLink* link)
+{
+    link->_prev = list._prev;
+    link->_next = &list;
+    list._prev->_next = link;
+    list._prev = link;
+}
+
+void Scheduler::Unlink(TimerLink* link)
+{
+    link->_prev->_next = link->_next;
+    link->_next->_prev = link->_prev;
+    link->_prev = link;
+    link->_next = link;
+}
+
 TINYNET_CLOSE()
\ No newline at end of file
@@ -2,7 +2,41 @@
 #include "Require.h"
 
 TINYNET_START()
-    
+
+/// what a periodic timer does when it runs late by a period or more
+
+enum TimerPolicy
+{
+    /// run once for every period missed, back to back
+    Timer_CatchUp,
+
+    /// run once and go on with the next period still ahead
+    Timer_Skip,
+};
+
+
+/// counters since the scheduler was created
+
+struct SchedulerStats
+{
+    uint64_t    _runs;
+
+    /// us from the due time to the start of a run
+    uint64_t    _lateTotal;
+    uint32_t    _lateMax;
+
+    /// periods dropped by Timer_Skip
+    uint64_t    _skips;
+};
+
+
+/// timers sit in a hierarchical wheel of 100 us ticks on the monotonic clock,
+/// scheduling and shutting down cost the same however many timers there are,
+/// a timer never fires before its due time
+
+/// periods are counted from the due time, not from when a run ends, a timer
+/// never runs twice at the same time
+
 class Scheduler
 {
 public:
@@ -12,71 +46,159 @@ public:
         return instance;
     }
 
-    Scheduler() : _running(0), _thread(NULL), _timerNext(0)
-    {
-    }
+    Scheduler();
+
+    ~Scheduler();
 
-    void Start();
+    /// with workers, callbacks run on that many threads of their own and the
+    /// scheduler thread only fires them, a slow callback delays no other timer
+    void Start(uint32_t workers = 0);
 
     void Close();
 
     /// first time in delay ms
     /// period = 0, run once
     /// period > 0, run periodically with period ms interval
-    uint32_t Schedule(const std::function<void()>& func, uint32_t delay, uint32_t period = 0);
-    
+    uint32_t Schedule(const std::function<void()>& func, uint32_t delay, uint32_t period = 0,
+        TimerPolicy policy = Timer_CatchUp);
+
+    /// the same below a millisecond
+    uint32_t Schedule(const std::function<void()>& func, std::chrono::microseconds delay,
+        std::chrono::microseconds period = std::chrono::microseconds::zero(), TimerPolicy policy = Timer_CatchUp);
+
     template<class T>
-    uint32_t Schedule(const T& func, uint32_t delay, uint32_t period = 0)
+    uint32_t Schedule(const T& func, uint32_t delay, uint32_t period = 0, TimerPolicy policy = Timer_CatchUp)
     {
-        return Schedule(std::function<void()>(func), delay, period);
+        return Schedule(std::function<void()>(func), delay, period, policy);
     }
 
-    /// if it's running, it'll wait until runs over 
+    /// if it's running, it'll wait until runs over, without holding up other
+    /// timers, returns at once from its own callback
     void ShutDown(uint32_t name);
-private:
-    static DWORD WINAPI ThreadProc(LPVOID);
 
+    /// never waits, false when there is no such timer, done is called once
+    /// the callback can no longer run, at once if not running, else by the
+    /// thread which runs it when the run ends
+    bool Cancel(uint32_t name, const std::function<void()>& done = nullptr);
+
+    SchedulerStats GetStats();
+
+    /// lateness and Timer_Skip go by the clock read for a batch of due timers
+    /// instead of reading it again for every run, so does Schedule unless the
+    /// loop is waiting, a timer then comes due early by up to one batch
+    void SetCoarseClock(bool coarse);
+private:
     void MainLoop();
 
-    HANDLE      _thread;
-    uint32_t    _running;
+    void WorkLoop();
+
+    std::thread    _thread;
+    uint32_t       _running;
+
+    std::vector<std::thread>    _workers;
 private:
-    struct Timer
+    struct TimerLink
+    {
+        TimerLink*    _prev;
+        TimerLink*    _next;
+    };
+
+    /// nodes are never freed while the scheduler lives, a name is the index
+    /// of its node and a generation which changes when it is released
+    struct Timer : public TimerLink
     {
         uint32_t    _name;
 
-        uint32_t    _dueTime;
-        uint32_t    _period;
+        /// us
+        uint64_t       _dueTime;
+        uint64_t       _period;
+        TimerPolicy    _policy;
+
+        bool    _running;
+        bool    _retired;
+
+        /// ShutDown from its own callback must not wait for itself
+        std::thread::id    _runner;
+
+        /// for Cancel of a running timer
+        std::function<void()>    _done;
 
-        volatile bool    _running;
-        volatile bool    _retired;
-        
         std::function<void()>    _action;
     };
 
-    typedef std::shared_ptr<Timer> TimerPtr;
+    static const uint32_t IndexBits = 20;
+    static const uint32_t IndexMask = (1u << IndexBits) - 1;
 
-    struct TimerComparer
-    {
-        bool operator()(const TimerPtr& lhs, const TimerPtr& rhs)
-        {
-            return lhs->_dueTime > rhs->_dueTime;
-        }
-    };
+    /// us
+    static const uint32_t TickSize = 100;
+
+    /// 256 slots of one tick, then 3 levels of 64 slots each 64 times coarser,
+    /// farther timers wait in the last slot and are placed again from there
+    static const uint32_t NearBits = 8;
+    static const uint32_t NearSize = 1u << NearBits;
+    static const uint32_t FarBits  = 6;
+    static const uint32_t FarSize  = 1u << FarBits;
+    static const uint32_t FarLevel = 3;
 
     typedef std::unique_lock<std::mutex> LockGuard;
 
-    typedef std::map<uint32_t, TimerPtr> TimerMap;
-    
-    typedef std::priority_queue<TimerPtr, std::vector<TimerPtr>, TimerComparer> TimerQueue;
+    /// us since the scheduler was created
+    uint64_t Now();
+
+    /// nullptr for a name which is gone
+    Timer* Find(uint32_t name);
+
+    Timer* Acquire();
+
+    void Release(Timer* timer);
+
+    void Add(Timer* timer);
+
+    /// move timers due by now to _expired, in us
+    void Advance(uint64_t now);
+
+    /// the first expired timer, the lock is released while it runs
+    void Run(LockGuard& guard);
+
+    /// us of the next tick with timers, no farther than the next cascade
+    uint64_t NextWait(uint64_t now);
+
+    static void Init(TimerLink& list);
+    static void Link(TimerLink& list, TimerLink* link);
+    static void Unlink(TimerLink* link);
 
     std::mutex    _timerLock;
-    TimerMap      _timerMap;
-    TimerQueue    _timerQueue;
 
-    volatile uint32_t    _timerNext;
-    
+    std::vector<Timer*>      _timers;
+    std::vector<uint32_t>    _free;
+
+    /// timers in the wheel and in _expired
+    uint32_t      _count;
+
+    /// next tick to expire
+    uint64_t      _tick;
+    TimerLink     _near[NearSize];
+    TimerLink     _far[FarLevel][FarSize];
+    TimerLink     _expired;
+
+    std::chrono::steady_clock::time_point    _base;
+
+    /// last read of the clock
+    uint64_t      _now;
+    bool          _coarse;
+
+    /// the loop is waiting till then, earlier timers have to wake it
+    bool          _waiting;
+    uint64_t      _waitUntil;
+
+    SchedulerStats    _stats;
+
     std::condition_variable    _condition;
+    std::condition_variable    _workCondition;
+
+    /// ShutDown callers waiting for a run to end
+    uint32_t                   _doneWaiters;
+    std::condition_variable    _doneCondition;
 };
 
 #define theScheduler Scheduler::Instance()
@@ -1,23 +1,17 @@
 #include "Socket.h"
 #include "Buffer.h"
 #include "Dispatcher.h"
-#include <mswsock.h>
+#include "IoPort.h"
+#include "Compress.h"
+#include "Pool.h"
 
 TINYNET_START()
 
-LPFN_ACCEPTEX  AcceptEx;
-LPFN_CONNECTEX ConnectEx;
-
-HANDLE __ioport;
-
-inline void Schedule(SocketEvent&& ev)
-{
-    theDispatcher.Enqueue(std::move(ev));
-}
-
-inline void ClearOverlapped(OVERLAPPED& overlapped)
+/// ms of the monotonic clock
+inline uint64_t GetLoopTime()
 {
-    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
 }
 
 inline sockaddr_in GetSockAddr()
@@ -42,162 +36,435 @@ class Socket;
 
 typedef RefCount<Socket> SocketRef;
 
-/// internal class
+/// internal class, an io thread with its own port and queues
 
-class Socket
+/// a socket is only touched by the loop owning it, so operations of one
+/// connection are kept in order
+
+class SocketLoop
 {
+    NOCOPYASSIGN(SocketLoop);
 public:
-    Socket(SOCKET socket) :
-        _socket(socket), _connected(false), _closed(false),
-        _sending(false), _sendOffset(0), _listen(false), _name(0)
+    SocketLoop(uint32_t pollBatch) :
+        _port(nullptr),
+        _running(0),
+        _events(pollBatch),
+        _polls(0),
+        _completions(0),
+        _recvAllocs(0),
+        _recvReuses(0),
+        _recvCopies(0),
+        _recvMemory(0),
+        _recvSockets(0),
+        _packRaw(0),
+        _packWire(0),
+        _sendDrops(0),
+        _recvPauses(0),
+        _timeouts(0),
+        _now(0),
+        _sleeping(false),
+        _dirty(false),
+        _sendQueue(nullptr)
     {
     }
 
-    Socket(SOCKET socket, SocketHandlerPtr& handler) :
-        _socket(socket), _handler(handler), _connected(false), _closed(false),
-        _sending(false), _sendOffset(0), _listen(false), _name(0)
+    ~SocketLoop()
     {
+        Close();
     }
 
-    Socket(SOCKET socket, ServerHandlerPtr& acceptHandler) :
-        _socket(socket), _acceptHandler(acceptHandler), _closed(false),
-        _sendOffset(0), _listen(true), _connected(false), _name(0)
+    bool Start();
+    void Close();
+
+    void GetStats(SocketStats& stats) const;
+
+    void Listen(uint32_t name, const std::string& addr, uint16_t port);
+
+    void Connect(uint32_t name, const std::string& addr, uint16_t port);
+
+    /// accepted by a listener of another loop
+    void Adopt(uint32_t name);
+
+    void Transfer(uint32_t name, const PacketPtr& packet, bool close);
+
+    /// a frame of a StreamWriter
+    void Transfer(uint32_t name, const PacketPtr& packet, const StreamWindowPtr& window);
+
+    /// names all owned by this loop
+    void Broadcast(const std::vector<uint32_t>& names, const PacketPtr& packet);
+
+    /// the members owned by this loop
+    void Broadcast(uint32_t group, const PacketPtr& packet);
+
+    void Join(uint32_t group, uint32_t name, bool join);
+
+    void ShutDown(uint32_t name);
+
+    void SetSendLimit(uint32_t name, const SendLimit& limit);
+    void SetRecvLimit(uint32_t name, const RecvLimit& limit);
+
+    void Resume(uint32_t name);
+
+    void SetTimeout(uint32_t name, const SocketTimeout& timeout);
+
+    IoPort*    _port;
+private:
+    friend class Socket;
+
+    void MainLoop();
+
+    void DoPoll();
+
+    void DoSend();
+
+    /// sockets due by _now
+    void DoTimeout();
+
+    /// drop a socket about to be removed from its groups
+    void LeaveGroups(Socket* socket);
+
+    /// only when the loop is blocked in Poll
+    void Wake();
+
+    uint32_t DoWait();
+
+    std::thread    _thread;
+    uint32_t       _running;
+
+    /// completions taken by one Poll
+    std::vector<IoEvent>    _events;
+
+    std::atomic<uint64_t>   _polls;
+    std::atomic<uint64_t>   _completions;
+
+    /// updated by the sockets of the loop, see SocketStats
+    std::atomic<uint64_t>   _recvAllocs;
+    std::atomic<uint64_t>   _recvReuses;
+    std::atomic<uint64_t>   _recvCopies;
+    std::atomic<uint64_t>   _recvMemory;
+    std::atomic<uint64_t>   _recvSockets;
+    std::atomic<uint64_t>   _packRaw;
+    std::atomic<uint64_t>   _packWire;
+    std::atomic<uint64_t>   _sendDrops;
+    std::atomic<uint64_t>   _recvPauses;
+    std::atomic<uint64_t>   _timeouts;
+
+    /// clock of the loop, read once for each Poll, sockets stamp their
+    /// activity with it
+    uint64_t    _now;
+
+    /// a wake for a timeout comes at a multiple of it, so that sockets due
+    /// close together are checked at once
+    static const uint32_t TimeoutTick = 10;
+
+    /// names of sockets with a SocketTimeout by due time, an entry holds no
+    /// reference and is only a hint, the socket checks its own times
+    typedef std::pair<uint64_t, uint32_t> TimeoutEntry;
+    std::priority_queue<TimeoutEntry, std::vector<TimeoutEntry>, std::greater<TimeoutEntry>>    _timeoutList;
+
+    /// set before the last look at the queues ahead of a blocking Poll
+    std::atomic<bool>    _sleeping;
+private:
+    struct SocketInfo
     {
-    }
+        SocketInfo(uint32_t name, const std::string& addr, uint16_t port) :
+            _name(name), _addr(addr), _port(port) { }
+
+        uint32_t       _name;
+        std::string    _addr;
+        uint16_t       _port;
+    };
 
-    static bool Initialize()
+    enum SendType
     {
-        SOCKET socket = Create();
-        if (socket == INVALID_SOCKET)
-            return false;
-        
-        GUID acceptEx  = WSAID_ACCEPTEX;
-        GUID connectEx = WSAID_CONNECTEX;
-        DWORD byteRead = 0;
-        DWORD ctrlCode = SIO_GET_EXTENSION_FUNCTION_POINTER; 
-        WSAIoctl(socket, ctrlCode, &acceptEx,  sizeof(GUID), &AcceptEx,  sizeof(AcceptEx),  &byteRead, 0, 0);
-        WSAIoctl(socket, ctrlCode, &connectEx, sizeof(GUID), &ConnectEx, sizeof(ConnectEx), &byteRead, 0, 0);
-        closesocket(socket);
+        Send_One,
+        Send_List,
+        Send_Group,
+        Send_Join,
+        Send_Leave,
+    };
+
+    /// group changes go the same way as sends to keep their order, a node
+    /// is one pool block with its names following it
+    struct SocketSend
+    {
+        static SocketSend* Create(SendType type, uint32_t name, const PacketPtr& data, size_t count = 0)
+        {
+            size_t capacity;
+            void* block = Pool::Alloc(sizeof(SocketSend) + count * sizeof(uint32_t), capacity);
+            return new (block) SocketSend(type, name, data, count);
+        }
 
-        return AcceptEx != NULL && ConnectEx != NULL;
-    }
-    
-    static SOCKET Create()
+        void Destroy()
+        {
+            this->~SocketSend();
+            Pool::Free(this);
+        }
+
+        /// for Send_List, and the socket for Send_Join and Send_Leave
+        uint32_t* Names()
+        {
+            return (uint32_t*)(this + 1);
+        }
+
+        SendType       _type;
+        /// group for Send_Group, Send_Join and Send_Leave
+        uint32_t       _name;
+        PacketPtr      _data;
+        bool           _close;
+        SocketSend*    _next;
+
+        /// of the writer for a frame
+        StreamWindowPtr    _window;
+
+        size_t         _count;
+    private:
+        SocketSend(SendType type, uint32_t name, const PacketPtr& data, size_t count) :
+            _type(type), _name(name), _data(data), _close(false), _next(nullptr), _count(count) { }
+    };
+
+    void Push(SocketSend* send);
+
+    std::atomic<bool>    _dirty;
+
+    Mutex   _queueLock;
+
+    std::vector<SocketInfo>    _listenQueue;
+
+    std::vector<SocketInfo>    _connectQueue;
+
+    std::vector<uint32_t>      _adoptQueue;
+
+    std::vector<uint32_t>      _closeQueue;
+
+    std::vector<std::pair<uint32_t, SendLimit>>    _limitQueue;
+    std::vector<std::pair<uint32_t, RecvLimit>>    _recvLimitQueue;
+    std::vector<uint32_t>      _resumeQueue;
+    std::vector<std::pair<uint32_t, SocketTimeout>>    _timeoutQueue;
+
+    /// lock free stack pushed by any thread, the loop takes it as a whole
+    std::atomic<SocketSend*>    _sendQueue;
+
+    /// members owned by this loop, only touched by it
+    std::map<uint32_t, std::set<Socket*>>    _groups;
+};
+
+//////////////////////////////////////////////////////////////////////
+
+/// internal class
+
+class Socket : public IoSocket
+{
+public:
+    Socket(SOCKET socket) : IoSocket(socket),
+        _connected(false), _closing(false),
+        _sending(false), _sendOffset(0), _listen(false), _name(0), _loop(nullptr),
+        _recvFrom(nullptr), _recvHeld(0), _recvStream(false), _recvParked(false)
     {
-        return WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+        _wire = Wire_Legacy;
+        _wireProbe = false;
+        _sendPreamble = false;
+        SetCompress(0);
+        InitSend();
+        InitTimeout();
     }
 
-    #pragma region Operations
-    
-    bool Bind(HANDLE completion)
+    Socket(SOCKET socket, SocketHandlerPtr& handler, WireFormat wire, uint32_t compress) : IoSocket(socket),
+        _handler(handler), _connected(false), _closing(false),
+        _sending(false), _sendOffset(0), _listen(false), _name(0), _loop(nullptr),
+        _recvFrom(nullptr), _recvHeld(0), _recvStream(false), _recvParked(false)
     {
-        HANDLE fileHandle = (HANDLE)_socket;
-        return CreateIoCompletionPort(fileHandle, completion, (ULONG_PTR)_self, 0) != NULL;
+        _wire = wire;
+        _wireProbe = false;
+        _sendPreamble = wire == Wire_Compact;
+        SetCompress(compress);
+        InitSend();
+        InitTimeout();
     }
 
-    bool Bind(sockaddr_in& addr)
+    Socket(SOCKET socket, ServerHandlerPtr& acceptHandler, WireFormat wire, uint32_t compress) : IoSocket(socket),
+        _acceptHandler(acceptHandler), _closing(false),
+        _sending(false), _sendOffset(0), _listen(true), _connected(false), _name(0), _loop(nullptr),
+        _recvFrom(nullptr), _recvHeld(0), _recvStream(false), _recvParked(false)
     {
-        return bind(_socket, (const sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+        _wire = wire;
+        _wireProbe = false;
+        _sendPreamble = false;
+        _compress = compress;
+        _packer = nullptr;
+        _unpacker = nullptr;
+        InitSend();
+        InitTimeout();
     }
 
-    bool Listen()
+    ~Socket()
     {
-        return listen(_socket, 32) != SOCKET_ERROR;
+        if (_recvHeld != 0) {
+            _recvBuffer.Reset();
+            _recvChunk.Reset();
+            UpdateRecvMemory();
+        }
+
+        delete _packer;
+        delete _unpacker;
     }
 
-    bool Accept(SOCKET accept)
+    /// before the socket runs, or in its loop
+    void SetRecvLimit(const RecvLimit& limit)
     {
-        ClearOverlapped(_recvOverlapped);
-        
-        DWORD size = sizeof(sockaddr_in) + 16;
-        return Check(AcceptEx(_socket, accept, _acceptBuffer, 0, size, size, NULL, &_recvOverlapped));
+        _recvLimit = limit;
+        if (_recvWindow.Get() == nullptr) {
+            if (limit._highEvents == 0 && limit._highBytes == 0)
+                return;
+
+            _recvWindow = MakeShared<RecvWindow>();
+            _recvWindow->_events = 0;
+            _recvWindow->_bytes = 0;
+            _recvWindow->_paused = false;
+        }
+        _recvWindow->_lowEvents = limit._highEvents != 0 ? limit._lowEvents : UINT32_MAX;
+        _recvWindow->_lowBytes  = limit._highBytes  != 0 ? limit._lowBytes  : UINT32_MAX;
     }
 
-    bool Connect(sockaddr_in& addr)
+    void DoRecvLimit(const RecvLimit& limit)
     {
-        ClearOverlapped(_sendOverlapped);
-        return Check(ConnectEx(_socket, (const sockaddr*)&addr, sizeof(addr), NULL, 0, NULL, &_sendOverlapped));
+        SetRecvLimit(limit);
+        if (_recvWindow.Get() != nullptr && _recvWindow->_paused && _recvWindow->UnderLow() && _recvWindow->_paused.exchange(false)) {
+            DoResume();
+        }
     }
 
-    bool Connect(const std::string& host, uint16_t port)
+    /// the dispatcher took the window back under the low watermarks
+    void DoResume()
     {
-        sockaddr_in addr = GetSockAddr(host, port);
-        return Connect(addr); 
+        if (!_closed && _recvParked) {
+            _recvParked = false;
+            _recvTime = _loop->_now;
+            BeginReceive();
+        }
     }
 
-    bool Send(void* data, size_t size)
+    void InitSend()
     {
-        _sendBuff.buf = (CHAR*)data;
-        _sendBuff.len = size;
+        memset(&_sendLimit, 0, sizeof(_sendLimit));
+        _sendBlocked = false;
+        _sendStream = false;
+        _sendBytes = 0;
+        _sendCount = 0;
+    }
 
-        ClearOverlapped(_sendOverlapped);
+    void InitTimeout()
+    {
+        memset(&_timeout, 0, sizeof(_timeout));
+        _timeoutDue = UINT64_MAX;
+        _connectTime = 0;
+        _recvTime = 0;
+        _sendTime = 0;
+    }
 
-        return Check(WSASend(_socket, &_sendBuff, 1, NULL, 0, &_sendOverlapped, NULL) != SOCKET_ERROR);
+    /// both sides of a connection have to agree
+    void SetCompress(uint32_t compress)
+    {
+        _compress = compress;
+        _packer   = compress != 0 ? new Compressor() : nullptr;
+        _unpacker = compress != 0 ? new Decompressor() : nullptr;
     }
 
-    bool Receive(void* data, size_t size)
+    /// on the preamble of an accepted peer, what it compresses is read
+    /// whatever was set, nothing is compressed for a peer which does not
+    void AgreeCompress(bool packed)
     {
-        _recvBuff.buf = (CHAR*)data;
-        _recvBuff.len = size;
+        if (packed) {
+            if (_unpacker == nullptr) {
+                _unpacker = new Decompressor();
+            }
+        } else {
+            _compress = 0;
+            delete _packer;
+            delete _unpacker;
+            _packer = nullptr;
+            _unpacker = nullptr;
+        }
+    }
 
-        ClearOverlapped(_recvOverlapped);
+    /// the queue of the handler is found once, a listener has none
+    void Schedule(SocketEvent&& socketEvent)
+    {
+        if (_listen) {
+            theDispatcher.Enqueue(std::move(socketEvent));
+            return;
+        }
 
-        DWORD RecvBytes, Flags = 0;
-        return Check(WSARecv(_socket, &_recvBuff, 1, &RecvBytes, &Flags, &_recvOverlapped, NULL) != SOCKET_ERROR);
+        if (_events.Get() == nullptr) {
+            _events = theDispatcher.Attach(_handler);
+        }
+        theDispatcher.Enqueue(_events, std::move(socketEvent));
     }
 
-    bool Check(BOOL status)
+    bool Check(bool status)
     {
-        return (status || WSAGetLastError() == ERROR_IO_PENDING) && _self->IncRef();
+        return status && _self->IncRef();
     }
 
-    #pragma endregion
-
     #pragma region Accept
 
     void DoAccept(const std::string& host, uint16_t port)
     {
         sockaddr_in addr = GetSockAddr(host, port);
-        if (!Bind(addr) || !Bind(__ioport) || !Listen()) {
+        if (!Bind(addr) || !Bind(_loop->_port) || !Listen()) {
             theManager.ShutDown(_name);
         } else {
             BeginAccept();
         }
     }
 
-    void OnAccept(BOOL status)
+    void OnAccept(bool status)
     {
         if (status) {
-            auto refer = theManager.GetSocket(_accept);
-            if (refer != nullptr) {
+            SocketRef* refer = new RefCount_Inplace<Socket>(_acceptSocket);
+            _acceptSocket = INVALID_SOCKET;
+
+            /// the peer tells with its first bytes whether it speaks compact
+            refer->Get()->_wire = _wire;
+            refer->Get()->_wireProbe = _wire == Wire_Compact;
+            refer->Get()->SetCompress(_compress);
+
+            /// no slot left, the peer is closed
+            uint32_t name = theManager.AddSocket(refer);
+            if (name == 0) {
+                refer->DecRef();
+            } else {
                 Socket* socket = refer->Get();
-                socket->_handler = _acceptHandler->OnAccept(_accept);
-                if (socket->Bind(__ioport)) {
-                    socket->_connected = true;
-                    Schedule(SocketEvent::MakeConnect(socket->_handler, _accept, true));
-                    socket->BeginReceive();
+                socket->_timeout = _timeout;
+                socket->_handler = _acceptHandler->OnAccept(name);
+                if (socket->_loop == _loop) {
+                    socket->DoAdopt();
                 } else {
-                    theManager.ShutDown(_accept);
+                    socket->_loop->Adopt(name);
                 }
             }
-        } else {
-            theManager.ShutDown(_accept);
         }
 
-        BeginAccept();
+        if (!_closed) {
+            BeginAccept();
+        }
     }
 
     void BeginAccept()
     {
-        SOCKET accept = Socket::Create();
-        if (accept == INVALID_SOCKET) {
+        if (!Check(Accept())) {
             theManager.ShutDown(_name);
-            return;
         }
+    }
 
-        _accept = theManager.AddSocket(MakeShared(new Socket(accept)));
-        if (!Accept(accept)) {
-            theManager.ShutDown(_accept);
+    void DoAdopt()
+    {
+        if (Bind(_loop->_port)) {
+            _connected = true;
+            Schedule(SocketEvent::MakeConnect(_handler, _name, true));
+            StartTimeout();
+            BeginReceive();
+        } else {
             theManager.ShutDown(_name);
         }
     }
@@ -209,17 +476,18 @@ public:
     void DoConnect(const std::string& host, uint16_t port)
     {
         sockaddr_in addr = GetSockAddr();
-        if (!Bind(addr) || !Bind(__ioport) || !Connect(host, port)) {
+        if (!Bind(addr) || !Bind(_loop->_port) || !Check(Connect(GetSockAddr(host, port)))) {
             Schedule(SocketEvent::MakeConnect(_handler, _name, false));
             theManager.ShutDown(_name);
         }
     }
 
-    void OnConnect(BOOL status)
+    void OnConnect(bool status)
     {
         if (status) {
             _connected = true;
             Schedule(SocketEvent::MakeConnect(_handler, _name, true));
+            StartTimeout();
 
             BeginSend();
             BeginReceive();
@@ -233,7 +501,7 @@ public:
     #pragma endregion
 
     #pragma region Receive
-    
+
     void OnReceive(uint32_t transfered)
     {
         if (transfered == 0) {
@@ -241,354 +509,1080 @@ public:
             return;
         }
 
+        _recvTime = _loop->_now;
         _recvBuffer->_base += transfered;
-        while (_recvBuffer->_base - _recvFrom >= 12) {
-            size_t* used = (size_t*)_recvFrom;
-            if (_recvBuffer->_base - _recvFrom >= *used + 12) {
-                PacketPtr packet = Packet::Create(_recvBuffer.GetRef(), _recvFrom);
-                Schedule(SocketEvent::MakeReceive(_handler, _name, packet));
-                _recvFrom += *used + 12;
+
+        if (_wireProbe) {
+            if (_recvBuffer->_base - _recvFrom < (ptrdiff_t)sizeof(Wire::Preamble)) {
+                BeginReceive();
+                return;
+            }
+
+            bool packed = memcmp(_recvFrom, Wire::PackPreamble, sizeof(Wire::PackPreamble)) == 0;
+            if (packed || memcmp(_recvFrom, Wire::Preamble, sizeof(Wire::Preamble)) == 0) {
+                _recvFrom += sizeof(Wire::Preamble);
             } else {
-                break;
+                _wire = Wire_Legacy;
+            }
+            AgreeCompress(packed);
+
+            /// sends were held back until the format was known
+            _wireProbe = false;
+            if (!_sending) {
+                BeginSend();
             }
         }
 
-        size_t newBufferSize = 0;
-        if (_recvBuffer->_base - _recvFrom >= 4) {
-            size_t* used = (size_t*)_recvFrom;
-            //ֱӶϿ
-            if (*used >= 65500) {
+        size_t left, need;
+        while (true) {
+            left = _recvBuffer->_base - _recvFrom;
+
+            WireHead head;
+            size_t headSize = Wire::DecodeHead(_wire, _recvFrom, left, head);
+            /// a corrupt header or a frame too long, disconnect
+            if (headSize == Wire::Invalid || (headSize != 0 && head._used >= 65500)) {
+                theManager.ShutDown(_name);
+                return;
+            }
+
+            /// room for a whole header, or the whole frame once the header is known
+            need = headSize != 0 ? headSize + head._used : 128;
+            if (headSize == 0 || left < need)
+                break;
+
+            PacketPtr packet = head._packed ? Unpack(head, _recvFrom + headSize) : TakePacket(head, headSize);
+            if (packet.Get() == nullptr) {
                 theManager.ShutDown(_name);
                 return;
             }
 
-            if (_recvBuffer->_last - _recvFrom < *used + 12) {
-                newBufferSize = *used + 12 + 1024;
+            /// frames of a streamed message go to OnStream, the last one without the flag
+            if (head._more || _recvStream) {
+                Deliver(SocketEvent::MakeStream(_handler, _name, std::move(packet), !head._more));
+                _recvStream = head._more;
+            } else {
+                Deliver(SocketEvent::MakeReceive(_handler, _name, std::move(packet)));
             }
-        } else if (_recvBuffer->_last - _recvFrom < 128) {
-            newBufferSize = 1024;
+            _recvFrom += need;
         }
 
-        if (newBufferSize != 0) {
-            BufferPtr newBuffer = Buffer::Create(newBufferSize);
-            uint8_t* newStart = newBuffer->_base;
-
-            newBuffer->Write(_recvFrom, _recvBuffer->_base - _recvFrom);
-            _recvFrom = newStart;
-            _recvBuffer = newBuffer;
+        /// an oversized message is done, back to the chunk
+        if (_recvBuffer.Get() != _recvChunk.Get() && left == 0) {
+            _recvBuffer = _recvChunk;
+            _recvFrom = _recvBuffer->_base;
         }
 
-        BeginReceive();
-    }
+        /// _recvBuffer holds the chunk too while no oversized message is received
+        uint32_t owned = _recvBuffer.Get() == _recvChunk.Get() ? 2 : 1;
+        bool alone = _recvChunk.GetRef()->IsUnique(owned);
+        if (_recvBuffer->_last - _recvFrom < (ptrdiff_t)need) {
+            if (need > RecvChunkSize) {
+                /// sized for this message alone, nothing after it is received into it,
+                /// compact frames leave room to turn the header into a packet in place
+                size_t reserve = _wire == Wire_Compact ? 12 : 0;
+                _recvBuffer = Buffer::Create(need + reserve);
+                _recvBuffer->_base += reserve;
+                _recvNeed = need;
+                _loop->_recvAllocs.fetch_add(1, std::memory_order_relaxed);
+            } else if (alone) {
+                _recvBuffer->_base = _recvBuffer->Start();
+                _loop->_recvReuses.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                _recvChunk = Buffer::Create(RecvChunkSize);
+                _recvBuffer = _recvChunk;
+                _loop->_recvAllocs.fetch_add(1, std::memory_order_relaxed);
+            }
 
-    void BeginReceive()
-    {
-        if (_recvBuffer.Get() == NULL) {
-            _recvBuffer = Buffer::Create(2048);
+            /// may overlap when the chunk is reused
+            memmove(_recvBuffer->_base, _recvFrom, left);
+            _recvFrom = _recvBuffer->_base;
+            _recvBuffer->_base += left;
+            UpdateRecvMemory();
+        } else if (left == 0 && alone && _recvBuffer.Get() == _recvChunk.Get()) {
+            _recvBuffer->_base = _recvBuffer->Start();
             _recvFrom = _recvBuffer->_base;
         }
 
-        if (!Receive(_recvBuffer->_base, _recvBuffer->_last - _recvBuffer->_base)) {
-            theManager.ShutDown(_name);
+        if (!PauseReceive()) {
+            BeginReceive();
         }
     }
-    
-    #pragma endregion
 
-    #pragma region Send
+    void Deliver(SocketEvent&& socketEvent)
+    {
+        if (_recvWindow.Get() != nullptr) {
+            _recvWindow->_events++;
+            _recvWindow->_bytes += socketEvent._packet->_used;
+            socketEvent._window = _recvWindow;
+        }
+        Schedule(std::move(socketEvent));
+    }
 
-    void DoSend(PacketPtr& packet, bool closing)
+    /// true when reads wait for the handler, the kernel buffers the rest and
+    /// tcp flow control holds the peer back
+    bool PauseReceive()
     {
-        _closing = _closing || closing;
+        if (_recvWindow.Get() == nullptr)
+            return false;
 
-        _sendQueue.push_back(packet);
-        if (!_sending && _connected) {
-            BeginSend();
-        }
+        if ((_recvLimit._highEvents == 0 || _recvWindow->_events < _recvLimit._highEvents)
+            && (_recvLimit._highBytes == 0 || _recvWindow->_bytes < _recvLimit._highBytes))
+            return false;
+
+        _recvWindow->_paused = true;
+        _loop->_recvPauses.fetch_add(1, std::memory_order_relaxed);
+
+        /// drained before the flag was seen, nobody else resumes
+        _recvParked = !(_recvWindow->UnderLow() && _recvWindow->_paused.exchange(false));
+        return _recvParked;
     }
 
-    void OnSend(uint32_t transfered)
+    /// small packets are copied out, a packet viewing into the chunk keeps
+    /// it from being reused until the handler drops it
+    PacketPtr TakePacket(const WireHead& head, size_t headSize)
     {
-        if (transfered == 0) {
-            theManager.ShutDown(_name);
-            return;
+        if (_unpacker != nullptr) {
+            _unpacker->Append(_recvFrom + headSize, head._used);
         }
 
-        _sendOffset += transfered;
+        bool own = _recvBuffer.Get() != _recvChunk.Get();
+        if (_wire == Wire_Legacy && (own || headSize + head._used > RecvCopySize)) {
+            *(uint32_t*)_recvFrom = head._used;
+            return Packet::Create(_recvBuffer.GetRef(), _recvFrom);
+        }
 
-        if (_sendPacket->_used + 12 == _sendOffset) {
-            _sendPacket.Reset();
+        uint8_t* body = _recvFrom + headSize;
+        if (own) {
+            /// over the header and the reserve in front of it
+            Packet* packet = (Packet*)(body - sizeof(Packet));
+            packet->_used = head._used;
+            packet->_type = head._type;
+            packet->_guid = head._guid;
+            return Packet::Create(_recvBuffer.GetRef(), (uint8_t*)&packet->_used);
         }
-        BeginSend();
+
+        PacketPtr packet = Packet::Create(head._used);
+        packet->_used = head._used;
+        packet->_type = head._type;
+        packet->_guid = head._guid;
+        memcpy((uint8_t*)(packet.Get() + 1), body, head._used);
+        _loop->_recvCopies.fetch_add(1, std::memory_order_relaxed);
+        return packet;
     }
 
-    void BeginSend()
+    /// null when the frame is corrupt or compression is off
+    PacketPtr Unpack(const WireHead& head, const uint8_t* body)
     {
-        if (_sendPacket.Get() == nullptr) {
-            _sendOffset = 0;
-            if (!_sendQueue.empty()) {
-                _sendPacket = _sendQueue.front();
-                _sendQueue.pop_front();
-            }
+        const uint8_t* raw;
+        size_t size;
+        if (_unpacker == nullptr || !_unpacker->Decompress(body, head._used, Packet::MaxCapacity, raw, size))
+            return PacketPtr();
+
+        PacketPtr packet = Packet::Create(size);
+        packet->_used = (uint32_t)size;
+        packet->_type = head._type;
+        packet->_guid = head._guid;
+        memcpy((uint8_t*)(packet.Get() + 1), raw, size);
+        return packet;
+    }
+
+    void BeginReceive()
+    {
+        if (_recvChunk.Get() == NULL) {
+            _recvChunk = Buffer::Create(RecvChunkSize);
+            _recvBuffer = _recvChunk;
+            _recvFrom = _recvBuffer->_base;
+            _loop->_recvAllocs.fetch_add(1, std::memory_order_relaxed);
+            UpdateRecvMemory();
         }
 
-        if (_sendPacket.Get() != nullptr) {
-            _sending = true;
-            if (!Send((uint8_t*)&_sendPacket->_used + _sendOffset, _sendPacket->_used + 12 - _sendOffset)) {
-                theManager.ShutDown(_name);
-            }
-        } else {
-            _sending = false;
+        uint8_t* last = _recvBuffer->_last;
+        if (_recvBuffer.Get() != _recvChunk.Get()) {
+            last = _recvFrom + _recvNeed;
         }
-    }
 
-    #pragma endregion
+        if (!Check(Receive(_recvBuffer->_base, last - _recvBuffer->_base))) {
+            theManager.ShutDown(_name);
+        }
+    }
 
-    void DoClose()
+    /// report the chunk and an oversized message buffer to the loop
+    void UpdateRecvMemory()
     {
-        if (!_closed) {
-            if (_listen) {
-                Schedule(SocketEvent::MakeClose(_acceptHandler, _name));
-            } else if (_connected) {
-                Schedule(SocketEvent::MakeClose(_handler, _name));
-            }
+        size_t held = 0;
+        if (_recvChunk.Get() != NULL) {
+            held += _recvChunk->_last - _recvChunk->Start();
+        }
+        if (_recvBuffer.Get() != _recvChunk.Get()) {
+            held += _recvBuffer->_last - _recvBuffer->Start();
+        }
 
-            closesocket(_socket);
-            _closed = true;
+        if (held != _recvHeld) {
+            _loop->_recvMemory.fetch_add(held - _recvHeld, std::memory_order_relaxed);
+            if (_recvHeld == 0 || held == 0) {
+                _loop->_recvSockets.fetch_add(held != 0 ? 1 : -1, std::memory_order_relaxed);
+            }
+            _recvHeld = held;
         }
     }
 
-    //General
-    SOCKET       _socket;
-    uint32_t     _name;
-    bool         _closed;
-    bool         _listen;
-    SocketRef*   _self;
-
-    //Accept
-    uint32_t            _accept;
-    ServerHandlerPtr    _acceptHandler;
+    #pragma endregion
 
-    //Connect
-    bool                _connected;
-    SocketHandlerPtr    _handler;
+    #pragma region Send
 
-    //Receive
-    uint8_t*     _recvFrom;
-    BufferPtr    _recvBuffer;
+    void DoSend(PacketPtr&& packet, bool closing, const StreamWindowPtr& window = StreamWindowPtr())
+    {
+        _closing = _closing || closing;
 
-    //Send
-    bool         _sending;
-    bool         _closing;
-    uint32_t     _sendOffset;
-    PacketPtr    _sendPacket;
-    std::list<PacketPtr>    _sendQueue;
+        /// the peer would take a packet between frames for the last one, it
+        /// goes after the last frame instead
+        bool frame = (packet->_used & Packet::StreamFlag) != 0;
+        if (_sendStream && !frame) {
+            _sendHeld.push_back(std::move(packet));
+            return;
+        }
+        _sendStream = frame && (packet->_used & Packet::MoreFlag) != 0;
 
-    //Internal
-    WSABUF           _recvBuff;
-    WSABUF           _sendBuff;
-    WSAOVERLAPPED    _sendOverlapped;
-    WSAOVERLAPPED    _recvOverlapped;
-    CHAR             _acceptBuffer[128];
+        /// frames of a writer are all queued before those of the next one
+        if (frame && window.Get() != nullptr) {
+            if (_sendWindows.empty() || _sendWindows.back().first.Get() != window.Get()) {
+                _sendWindows.push_back(std::make_pair(window, 0u));
+            }
+            _sendWindows.back().second++;
+        }
 
-    static void DoPoll()
-    {
-        DWORD           transfered = 0;
-        ULONG_PTR       completion = 0;
-        LPOVERLAPPED    overlapped = nullptr;
+        uint32_t size = QueuedSize(packet.Get());
+        if (OverHigh(size, 1)) {
+            /// a dropped frame would break the message, the writer waits instead
+            SendPolicy policy = _sendLimit._policy;
+            if (frame && policy != Policy_Disconnect) {
+                policy = Policy_Keep;
+            }
 
-        BOOL status = GetQueuedCompletionStatus(__ioport, &transfered,
-            &completion, &overlapped, 1);
+            switch (policy)
+            {
+            case Policy_DropOldest:
+                /// only what is not being written yet
+                for (auto iter = _sendQueue.begin(); iter != _sendQueue.end() && OverHigh(size, 1); ) {
+                    if ((*iter)->_used & Packet::StreamFlag) {
+                        ++iter;
+                        continue;
+                    }
+                    AddQueued(-(int32_t)QueuedSize(iter->Get()), -1);
+                    iter = _sendQueue.erase(iter);
+                    _loop->_sendDrops.fetch_add(1, std::memory_order_relaxed);
+                }
+                break;
+            case Policy_DropNew:
+                _loop->_sendDrops.fetch_add(1, std::memory_order_relaxed);
+                SetBlocked(true);
+                return;
+            case Policy_Disconnect:
+                theManager.ShutDown(_name);
+                return;
+            default:
+                break;
+            }
+            SetBlocked(true);
+        }
 
-        if (overlapped != nullptr) {
-            SocketRef* refer = (SocketRef*)completion;
-            
-            Socket* socket = refer->Get();
+        AddQueued(size, 1);
+        _sendQueue.push_back(std::move(packet));
+        if (!_sending && _connected) {
+            BeginSend();
+        }
 
-            /// assume after DoClose, [OnAccept, OnReceive, OnSend, OnConnect] all return failure
-            if (overlapped == &socket->_recvOverlapped) {
-                if (socket->_listen) {
-                    socket->OnAccept(status);
-                } else {
-                    socket->OnReceive(transfered);
-                }
-            } else {
-                if (socket->_connected) {
-                    socket->OnSend(transfered);
-                } else {
-                    socket->OnConnect(status);
-                }
+        /// the message is whole, what was held goes under SendLimit as usual
+        if (frame && !_sendStream) {
+            while (!_sendHeld.empty()) {
+                PacketPtr held = std::move(_sendHeld.front());
+                _sendHeld.pop_front();
+                DoSend(std::move(held), false);
             }
-            refer->DecRef();
         }
     }
 
-    static uint32_t DoWait()
+    /// a frame as its writer counted it was written
+    void ReleaseFrame(uint32_t size)
     {
-        DWORD           transfered = 0;
-        ULONG_PTR       completion = 0;
-        LPOVERLAPPED    overlapped = nullptr;
-
-        GetQueuedCompletionStatus(__ioport, &transfered,
-            &completion, &overlapped, 0);
-
-        if (overlapped != nullptr) {
-            SocketRef* refer = (SocketRef*)completion;
-            return refer->DecRef();
+        if (!_sendWindows.empty()) {
+            _sendWindows.front().first->Release(size);
+            if (--_sendWindows.front().second == 0) {
+                _sendWindows.pop_front();
+            }
         }
-        return 0;
     }
-};
 
-//////////////////////////////////////////////////////////////////////
+    void OnSend(uint32_t transfered)
+    {
+        if (transfered == 0) {
+            theManager.ShutDown(_name);
+            return;
+        }
 
-DWORD WINAPI SocketManager::ThreadProc(LPVOID)
-{
-    theManager.MainLoop();
-    return 0;
-}
+        _sendTime = _loop->_now;
+        if (_sendPreamble) {
+            uint32_t left = sizeof(Wire::Preamble) - _sendOffset;
+            if (transfered < left) {
+                _sendOffset += transfered;
+                transfered = 0;
+            } else {
+                transfered -= left;
+                _sendOffset = 0;
+                _sendPreamble = false;
+            }
+        }
 
-void SocketManager::Start(uint32_t numOfWorkThread)
-{
-    if (InterlockedCompareExchange(&_running, 1, 0) == 0) {
-        WSADATA wsaData;
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
-            throw std::exception("SocketManager::Start, 1");
+        /// may stop in the middle of any gathered packet
+        while (transfered > 0) {
+            uint32_t left = FrameSize(_sendPackets.front().Get()) - _sendOffset;
+            if (transfered < left) {
+                _sendOffset += transfered;
+                break;
+            }
 
-        if (LOBYTE(wsaData.wVersion) != 2 || HIBYTE(wsaData.wVersion) != 2)
-            throw std::exception("SocketManager::Start, 2");
+            transfered -= left;
+            _sendOffset = 0;
+            AddQueued(-(int32_t)QueuedSize(_sendPackets.front().Get()), -1);
+            _sendPackets.pop_front();
 
-        if (!Socket::Initialize())
-            throw std::exception("SocketManager::Start, 3");
+            if (_sendFrames.front() != 0) {
+                ReleaseFrame(_sendFrames.front());
+            }
+            _sendFrames.pop_front();
+        }
 
-        _completion = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-        if (_completion == NULL)
-            throw std::exception("SocketManager::Start, 4");
+        if (_sendBlocked && UnderLow()) {
+            SetBlocked(false);
+        }
+        BeginSend();
+    }
 
-        _thread = CreateThread(NULL, 0, &SocketManager::ThreadProc, NULL, 0, NULL);
-        if (_thread == NULL)
-            throw std::exception("SocketManager::Start, 6");
+    static uint32_t QueuedSize(const Packet* packet)
+    {
+        return (packet->_used & ~Packet::FlagMask) + 12;
+    }
 
-        __ioport = _completion;
+    /// only the loop writes them, other threads read under _socketsLock
+    void AddQueued(int32_t bytes, int32_t count)
+    {
+        _sendBytes.store(_sendBytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+        _sendCount.store(_sendCount.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
 
-        theDispatcher.Start(numOfWorkThread);
+    /// with bytes and count more queued
+    bool OverHigh(uint32_t bytes, uint32_t count) const
+    {
+        return (_sendLimit._highBytes != 0 && _sendBytes.load(std::memory_order_relaxed) + bytes > _sendLimit._highBytes)
+            || (_sendLimit._highPackets != 0 && _sendCount.load(std::memory_order_relaxed) + count > _sendLimit._highPackets);
     }
-}
 
-void SocketManager::Close()
-{
-    theDispatcher.Close();
+    bool UnderLow() const
+    {
+        return (_sendLimit._highBytes == 0 || _sendBytes.load(std::memory_order_relaxed) <= _sendLimit._lowBytes)
+            && (_sendLimit._highPackets == 0 || _sendCount.load(std::memory_order_relaxed) <= _sendLimit._lowPackets);
+    }
 
-    if (InterlockedCompareExchange(&_running, 0, 1) == 1) {
-        _dirty = true;
+    /// OnBackpressure once on the way up, OnWritable once on the way down
+    void SetBlocked(bool blocked)
+    {
+        if (_sendBlocked != blocked) {
+            _sendBlocked = blocked;
+            if (_connected) {
+                Schedule(SocketEvent::MakeBackpressure(_handler, _name, blocked));
+            }
+        }
+    }
+
+    void DoSendLimit(const SendLimit& limit)
+    {
+        _sendLimit = limit;
+        if (_sendBlocked && UnderLow()) {
+            SetBlocked(false);
+        }
+    }
+
+    /// in the order packets go out, which is the order the peer unpacks them
+    PacketPtr Pack(PacketPtr&& packet)
+    {
+        if (_packer == nullptr)
+            return std::move(packet);
+
+        uint32_t used = packet->_used & ~Packet::FlagMask;
+        const uint8_t* body = (uint8_t*)(packet.Get() + 1);
+        if (used < _compress || Compressor::Bound(used) > Packet::MaxCapacity) {
+            _packer->Append(body, used);
+            return std::move(packet);
+        }
+
+        PacketPtr packed = Packet::Create(Compressor::Bound(used));
+        size_t size = _packer->Compress(body, used, (uint8_t*)(packed.Get() + 1), packed->_size);
+        if (size == 0)
+            return std::move(packet);
+
+        packed->_used = (uint32_t)size | Packet::PackFlag | (packet->_used & Packet::MoreFlag);
+        packed->_type = packet->_type;
+        packed->_guid = packet->_guid;
+
+        _loop->_packRaw.fetch_add(used, std::memory_order_relaxed);
+        _loop->_packWire.fetch_add(size, std::memory_order_relaxed);
+        return packed;
+    }
+
+    uint32_t FrameSize(const Packet* packet)
+    {
+        uint32_t used = packet->_used & ~Packet::FlagMask;
+        if (_wire == Wire_Legacy)
+            return used + 12;
+
+        uint8_t head[Wire::HeadMax];
+        return Wire::EncodeHead(_wire, packet, head) + used;
+    }
+
+    void BeginSend()
+    {
+        /// nothing goes out before the format of an accepted peer is known
+        if (_wireProbe) {
+            _sending = false;
+            return;
+        }
+
+        IoBuffer buffers[IoGatherCount];
+        size_t   count = 0;
+        size_t   bytes = 0;
+
+        uint32_t offset = _sendOffset;
+        if (_sendPreamble) {
+            buffers[count]._data = (_packer != nullptr ? Wire::PackPreamble : Wire::Preamble) + offset;
+            buffers[count]._size = sizeof(Wire::Preamble) - offset;
+            bytes += buffers[count]._size;
+            count++;
+            offset = 0;
+        }
+
+        /// a compact frame takes two pieces, the encoded header and the body
+        size_t pieces = _wire == Wire_Legacy ? 1 : 2;
+
+        /// unfinished packets first, then more from the queue within the budget
+        for (size_t index = 0; count + pieces <= IoGatherCount && bytes < MaxGatherSize; index++) {
+            if (index == _sendPackets.size()) {
+                if (_sendQueue.empty())
+                    break;
+
+                /// compressed packets count with their new size, a frame is
+                /// only held by its socket, other packets may be shared
+                Packet* front = _sendQueue.front().Get();
+                uint32_t size = QueuedSize(front);
+                bool frame = (front->_used & Packet::StreamFlag) != 0;
+                if (frame) {
+                    front->_used &= ~Packet::StreamFlag;
+                }
+                _sendFrames.push_back(frame ? size : 0);
+                _sendPackets.push_back(Pack(std::move(_sendQueue.front())));
+                _sendQueue.pop_front();
+                AddQueued(QueuedSize(_sendPackets.back().Get()) - size, 0);
+            }
+
+            Packet* packet = _sendPackets[index].Get();
+            uint32_t used = packet->_used & ~Packet::FlagMask;
+            if (_wire == Wire_Legacy) {
+                buffers[count]._data = (uint8_t*)&packet->_used + offset;
+                buffers[count]._size = used + 12 - offset;
+                bytes += buffers[count]._size;
+                count++;
+            } else {
+                uint8_t* head = _sendHeads[index];
+                size_t headSize = Wire::EncodeHead(_wire, packet, head);
+                if (offset < headSize) {
+                    buffers[count]._data = head + offset;
+                    buffers[count]._size = headSize - offset;
+                    bytes += buffers[count]._size;
+                    count++;
+                    offset = 0;
+                } else {
+                    offset -= headSize;
+                }
+
+                if (used > offset) {
+                    buffers[count]._data = (uint8_t*)(packet + 1) + offset;
+                    buffers[count]._size = used - offset;
+                    bytes += buffers[count]._size;
+                    count++;
+                }
+            }
+            offset = 0;
+        }
+
+        if (count != 0) {
+            _sending = true;
+            if (!Check(Send(buffers, count))) {
+                theManager.ShutDown(_name);
+            }
+        } else {
+            _sending = false;
+        }
+    }
+
+    #pragma endregion
+
+    #pragma region Timeout
+
+    void DoTimeout(const SocketTimeout& timeout)
+    {
+        _timeout = timeout;
+        if (_connected && !_closed) {
+            ArmTimeout();
+        }
+    }
+
+    void StartTimeout()
+    {
+        _connectTime = _loop->_now;
+        _recvTime = _loop->_now;
+        _sendTime = _loop->_now;
+        ArmTimeout();
+    }
 
-        if (_thread != NULL) {
-            WaitForSingleObject(_thread, INFINITE);
-            CloseHandle(_thread);
-            _thread = NULL;
+    /// the first time a limit may be reached, UINT64_MAX for none
+    uint64_t NextTimeout() const
+    {
+        uint64_t due = UINT64_MAX;
+        if (_timeout._readIdle != 0) {
+            due = std::min(due, _recvTime + _timeout._readIdle);
+        }
+        if (_timeout._writeIdle != 0) {
+            due = std::min(due, _sendTime + _timeout._writeIdle);
         }
+        if (_timeout._lifetime != 0) {
+            due = std::min(due, _connectTime + _timeout._lifetime);
+        }
+        if (Probing()) {
+            due = std::min(due, _connectTime + ProbeTime);
+        }
+        return due;
+    }
+
+    /// an accepted peer which has not sent a byte yet
+    bool Probing() const
+    {
+        return _wireProbe && (_recvBuffer.Get() == nullptr || _recvBuffer->_base == _recvFrom);
+    }
+
+    /// activity only moves the times, the entry in the loop stays until it
+    /// comes up and is put back for the new due time
+    void ArmTimeout()
+    {
+        uint64_t due = NextTimeout();
+        if (due < _timeoutDue) {
+            _timeoutDue = due;
+            _loop->_timeoutList.push(std::make_pair(due, _name));
+        }
+    }
+
+    /// an entry of due came up
+    void OnTimeout(uint64_t due, uint64_t now)
+    {
+        /// a later entry left behind by an earlier one
+        if (due != _timeoutDue || _closed)
+            return;
+
+        /// not idle while reads wait for the handler, RecvLimit holds the peer
+        if (_recvParked) {
+            _recvTime = now;
+        }
+
+        _timeoutDue = UINT64_MAX;
+        if ((_timeout._readIdle != 0 && now - _recvTime >= _timeout._readIdle)
+            || (_timeout._lifetime != 0 && now - _connectTime >= _timeout._lifetime)) {
+            _loop->_timeouts.fetch_add(1, std::memory_order_relaxed);
+            theManager.ShutDown(_name);
+            return;
+        }
+
+        /// a legacy peer may wait for us to speak first
+        if (Probing() && now - _connectTime >= ProbeTime) {
+            _wire = Wire_Legacy;
+            _wireProbe = false;
+            AgreeCompress(false);
+            if (!_sending) {
+                BeginSend();
+            }
+        }
+
+        /// a write which does not complete is left to SendLimit
+        if (_timeout._writeIdle != 0 && now - _sendTime >= _timeout._writeIdle) {
+            if (!_sending) {
+                Schedule(SocketEvent::MakeWriteIdle(_handler, _name));
+            }
+            _sendTime = now;
+        }
+        ArmTimeout();
+    }
+
+    #pragma endregion
+
+    void DoClose()
+    {
+        if (!_closed) {
+            if (_listen) {
+                Schedule(SocketEvent::MakeClose(_acceptHandler, _name));
+            } else if (_connected) {
+                Schedule(SocketEvent::MakeClose(_handler, _name));
+            }
+
+            /// writers waiting for frames of this socket give up
+            for (auto& window : _sendWindows) {
+                window.first->Close();
+            }
+            _sendWindows.clear();
+            _sendHeld.clear();
+
+            Close();
+        }
+    }
+
+    //General
+    uint32_t     _name;
+    bool         _listen;
+    SocketRef*   _self;
+    SocketLoop*  _loop;
+
+    //Accept
+    ServerHandlerPtr    _acceptHandler;
+
+    //Connect
+    bool                _connected;
+    SocketHandlerPtr    _handler;
+
+    /// of _handler from the first event on
+    SocketEventQueuePtr    _events;
+
+    //Receive
+    uint8_t*     _recvFrom;
+    BufferPtr    _recvBuffer;
+    BufferPtr    _recvChunk;
+    size_t       _recvHeld;
+    bool         _recvStream;
+
+    /// frame size of an oversized message
+    size_t       _recvNeed;
+
+    /// only there while limited, reads are not posted while paused
+    RecvLimit        _recvLimit;
+    RecvWindowPtr    _recvWindow;
+
+    /// paused with no read posted, until DoResume
+    bool             _recvParked;
+
+    /// rounded up to the 4K pool class
+    static const size_t RecvChunkSize = 4000;
+
+    /// packets up to this are copied out of the chunk
+    static const size_t RecvCopySize = 512;
+
+    //Send
+    bool         _sending;
+    bool         _closing;
+    uint32_t     _sendOffset;
+    std::deque<PacketPtr>   _sendPackets;
+    std::list<PacketPtr>    _sendQueue;
+
+    /// sizes of the frames in _sendPackets as their writers counted them, 0
+    /// for other packets
+    std::deque<uint32_t>    _sendFrames;
+
+    /// writers of the frames queued with the number not written yet, in order
+    std::deque<std::pair<StreamWindowPtr, uint32_t>>    _sendWindows;
+
+    /// sent while a StreamWriter is in the middle of a message
+    std::deque<PacketPtr>   _sendHeld;
+
+    SendLimit               _sendLimit;
+    bool                    _sendBlocked;
+
+    /// a frame with MoreFlag of a StreamWriter was queued last
+    bool                    _sendStream;
+
+    /// bytes and packets in _sendPackets and _sendQueue
+    std::atomic<uint32_t>   _sendBytes;
+    std::atomic<uint32_t>   _sendCount;
+
+    /// compact headers of the packets being sent, by index in _sendPackets
+    bool         _sendPreamble;
+    uint8_t      _sendHeads[IoGatherCount][Wire::HeadMax];
+
+    /// groups joined, see SocketLoop::_groups
+    std::vector<uint32_t>   _groups;
 
-        if (_completion != NULL) {
-            CloseHandle(_completion);
-            _completion = NULL;
+    //Timeout
+    SocketTimeout    _timeout;
+
+    /// of the earliest entry in SocketLoop::_timeoutList, UINT64_MAX for none
+    uint64_t         _timeoutDue;
+
+    /// SocketLoop::_now of the last activity
+    uint64_t         _connectTime;
+    uint64_t         _recvTime;
+    uint64_t         _sendTime;
+
+    //Wire
+    WireFormat   _wire;
+    bool         _wireProbe;
+
+    /// ms an accepted peer has to send the preamble before it is taken for legacy
+    static const uint32_t ProbeTime = 500;
+
+    /// smallest body compressed, 0 when off
+    uint32_t       _compress;
+    Compressor*    _packer;
+    Decompressor*  _unpacker;
+
+    /// bytes gathered into one send
+    static const size_t MaxGatherSize = 64 * 1024;
+
+    static void Dispatch(IoEvent& event)
+    {
+        Socket* socket = static_cast<Socket*>(event._socket);
+        SocketRef* refer = socket->_self;
+
+        /// assume after DoClose, [OnAccept, OnReceive, OnSend, OnConnect] all return failure
+        switch (event._operation)
+        {
+        case IoOp_Accept:
+            socket->OnAccept(event._status);
+            break;
+        case IoOp_Connect:
+            socket->OnConnect(event._status);
+            break;
+        case IoOp_Receive:
+            socket->OnReceive(event._transfered);
+            break;
+        case IoOp_Send:
+            socket->OnSend(event._transfered);
+            break;
         }
+        refer->DecRef();
+    }
+};
+
+//////////////////////////////////////////////////////////////////////
+
+bool SocketLoop::Start()
+{
+    _port = new IoPort;
+    if (!_port->Open())
+        return false;
+
+    _running = 1;
+    _now = GetLoopTime();
+    _thread = std::thread(&SocketLoop::MainLoop, this);
+    return true;
+}
+
+void SocketLoop::Close()
+{
+    if (InterlockedCompareExchange(&_running, 0, 1) == 1) {
+        _port->Wake();
+    }
+
+    if (_thread.joinable()) {
+        _thread.join();
+    }
 
-        WSACleanup();
+    if (_port != nullptr) {
+        delete _port;
+        _port = nullptr;
     }
 }
 
-void SocketManager::MainLoop()
+void SocketLoop::DoPoll()
 {
-    while (_running) {
-        Socket::DoPoll();
+    /// producers publish first and then look at _sleeping, so either they
+    /// see it and wake the port or the queues are seen non empty here
+    _sleeping = true;
+
+    uint32_t timeout = IoInfinite;
+    if (_sendQueue.load() != nullptr || _dirty || !_running) {
+        timeout = 0;
+    } else if (!_timeoutList.empty()) {
+        uint64_t due = (_timeoutList.top().first / TimeoutTick + 1) * TimeoutTick;
+        timeout = due > _now ? (uint32_t)std::min<uint64_t>(due - _now, IoInfinite - 1) : 0;
+    }
+
+    size_t count = _port->Poll(_events.data(), _events.size(), timeout);
+    _sleeping = false;
+    _now = GetLoopTime();
+
+    if (count != 0) {
+        _polls.fetch_add(1, std::memory_order_relaxed);
+        _completions.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    /// all of them before the queues are looked at again
+    for (size_t i = 0; i < count; i++) {
+        Socket::Dispatch(_events[i]);
+    }
+}
+
+void SocketLoop::Wake()
+{
+    if (_sleeping.exchange(false)) {
+        _port->Wake();
+    }
+}
+
+uint32_t SocketLoop::DoWait()
+{
+    /// number of sockets left with only the reference of the loop
+    uint32_t count = 0;
 
-        if (_sending) {
-            std::vector<SocketSend>    sendQueue;
+    size_t filled = _port->Poll(_events.data(), _events.size(), 0);
+    for (size_t i = 0; i < filled; i++) {
+        Socket* socket = static_cast<Socket*>(_events[i]._socket);
+        if (socket->_self->DecRef() == 1) { count++; }
+    }
+    return count;
+}
+
+void SocketLoop::GetStats(SocketStats& stats) const
+{
+    stats._polls += _polls.load(std::memory_order_relaxed);
+    stats._completions += _completions.load(std::memory_order_relaxed);
+    stats._recvAllocs  += _recvAllocs.load(std::memory_order_relaxed);
+    stats._recvReuses  += _recvReuses.load(std::memory_order_relaxed);
+    stats._recvCopies  += _recvCopies.load(std::memory_order_relaxed);
+    stats._recvMemory  += _recvMemory.load(std::memory_order_relaxed);
+    stats._recvSockets += _recvSockets.load(std::memory_order_relaxed);
+    stats._packRaw     += _packRaw.load(std::memory_order_relaxed);
+    stats._packWire    += _packWire.load(std::memory_order_relaxed);
+    stats._sendDrops   += _sendDrops.load(std::memory_order_relaxed);
+    stats._recvPauses  += _recvPauses.load(std::memory_order_relaxed);
+    stats._timeouts    += _timeouts.load(std::memory_order_relaxed);
+}
+
+void SocketLoop::DoSend()
+{
+    /// newest first, reverse to keep the order of Transfer
+    SocketSend* send = _sendQueue.exchange(nullptr, std::memory_order_acquire);
+    SocketSend* list = nullptr;
+    while (send != nullptr) {
+        SocketSend* next = send->_next;
+        send->_next = list;
+        list = send;
+        send = next;
+    }
+
+    /// names sent to all belong to this loop, which is the only one to remove them
+    while (list != nullptr) {
+        SocketSend* next = list->_next;
+        switch (list->_type)
+        {
+        case Send_One:
             {
-                MutexGuard guard(_sendLock);
-                sendQueue = std::move(_sendQueue);
-                _sendQueue.reserve(10000);
-                _sending = false;
+                auto refer = theManager.GetSocket(list->_name);
+                if (refer != nullptr) {
+                    refer->Get()->DoSend(std::move(list->_data), list->_close, list->_window);
+                } else if (list->_window.Get() != nullptr) {
+                    list->_window->Close();
+                }
             }
-
-            for (auto& send : sendQueue) {
-                auto refer = GetSocket(send._name);
+            break;
+        case Send_List:
+            for (size_t i = 0; i < list->_count; i++) {
+                auto refer = theManager.GetSocket(list->Names()[i]);
                 if (refer != nullptr) {
-                    refer->Get()->DoSend(send._data, send._close);
+                    refer->Get()->DoSend(PacketPtr(list->_data), false);
+                }
+            }
+            break;
+        case Send_Group:
+            {
+                auto iter = _groups.find(list->_name);
+                if (iter != _groups.end()) {
+                    for (auto socket : iter->second) {
+                        socket->DoSend(PacketPtr(list->_data), false);
+                    }
                 }
             }
+            break;
+        case Send_Join:
+        case Send_Leave:
+            {
+                auto refer = theManager.GetSocket(list->Names()[0]);
+                Socket* socket = refer != nullptr ? refer->Get() : nullptr;
+                if (socket != nullptr && socket->_loop == this) {
+                    if (list->_type == Send_Join) {
+                        if (_groups[list->_name].insert(socket).second) {
+                            socket->_groups.push_back(list->_name);
+                        }
+                    } else {
+                        auto iter = _groups.find(list->_name);
+                        if (iter != _groups.end() && iter->second.erase(socket) != 0) {
+                            if (iter->second.empty()) { _groups.erase(iter); }
+                            auto& groups = socket->_groups;
+                            groups.erase(std::find(groups.begin(), groups.end(), list->_name));
+                        }
+                    }
+                }
+            }
+            break;
+        }
+        list->Destroy();
+        list = next;
+    }
+}
+
+void SocketLoop::DoTimeout()
+{
+    while (!_timeoutList.empty() && _timeoutList.top().first <= _now) {
+        TimeoutEntry entry = _timeoutList.top();
+        _timeoutList.pop();
+
+        /// gone if closed since
+        auto refer = theManager.GetSocket(entry.second);
+        if (refer != nullptr) {
+            refer->Get()->OnTimeout(entry.first, _now);
+        }
+    }
+}
+
+void SocketLoop::LeaveGroups(Socket* socket)
+{
+    for (auto group : socket->_groups) {
+        auto iter = _groups.find(group);
+        if (iter != _groups.end()) {
+            iter->second.erase(socket);
+            if (iter->second.empty()) { _groups.erase(iter); }
+        }
+    }
+    socket->_groups.clear();
+}
+
+void SocketLoop::MainLoop()
+{
+    while (_running) {
+        DoPoll();
+
+        if (_sendQueue.load(std::memory_order_relaxed) != nullptr) {
+            DoSend();
+        }
+
+        if (!_timeoutList.empty() && _timeoutList.top().first <= _now) {
+            DoTimeout();
         }
 
         if (_dirty) {
             std::vector<SocketInfo>    listenQueue;
             std::vector<SocketInfo>    connectQueue;
+            std::vector<uint32_t>      adoptQueue;
             std::vector<uint32_t>      closeQueue;
+            std::vector<std::pair<uint32_t, SendLimit>>    limitQueue;
+            std::vector<std::pair<uint32_t, RecvLimit>>    recvLimitQueue;
+            std::vector<uint32_t>      resumeQueue;
+            std::vector<std::pair<uint32_t, SocketTimeout>>    timeoutQueue;
             {
                 MutexGuard guard(_queueLock);
                 listenQueue  = std::move(_listenQueue);
                 connectQueue = std::move(_connectQueue);
+                adoptQueue   = std::move(_adoptQueue);
                 closeQueue   = std::move(_closeQueue);
+                limitQueue   = std::move(_limitQueue);
+                recvLimitQueue = std::move(_recvLimitQueue);
+                resumeQueue  = std::move(_resumeQueue);
+                timeoutQueue = std::move(_timeoutQueue);
                 _dirty       = false;
             }
 
             for (auto name : closeQueue) {
-                RefCount<Socket>* refer = nullptr;
-                {
-                    MutexGuard guard(_socketsLock);
-                    auto iter = _sockets.find(name);
-                    if (iter != _sockets.end()) {
-                        refer = iter->second;
-                        _sockets.erase(iter);
-                    }
-                }
-
+                auto refer = theManager.RemoveSocket(name);
                 if (refer != nullptr) {
+                    LeaveGroups(refer->Get());
                     refer->Get()->DoClose();
                     refer->DecRef();
                 }
             }
 
             for (auto& info : listenQueue) {
-                auto refer = GetSocket(info._name);
+                auto refer = theManager.GetSocket(info._name);
                 if (refer != nullptr) {
                     refer->Get()->DoAccept(info._addr, info._port);
                 }
             }
 
             for (auto& info : connectQueue) {
-                auto refer = GetSocket(info._name);
+                auto refer = theManager.GetSocket(info._name);
                 if (refer != nullptr) {
                     refer->Get()->DoConnect(info._addr, info._port);
                 }
             }
+
+            for (auto name : adoptQueue) {
+                auto refer = theManager.GetSocket(name);
+                if (refer != nullptr) {
+                    refer->Get()->DoAdopt();
+                }
+            }
+
+            for (auto& limit : limitQueue) {
+                auto refer = theManager.GetSocket(limit.first);
+                if (refer != nullptr) {
+                    refer->Get()->DoSendLimit(limit.second);
+                }
+            }
+
+            for (auto& limit : recvLimitQueue) {
+                auto refer = theManager.GetSocket(limit.first);
+                if (refer != nullptr) {
+                    refer->Get()->DoRecvLimit(limit.second);
+                }
+            }
+
+            for (auto name : resumeQueue) {
+                auto refer = theManager.GetSocket(name);
+                if (refer != nullptr) {
+                    refer->Get()->DoResume();
+                }
+            }
+
+            for (auto& timeout : timeoutQueue) {
+                auto refer = theManager.GetSocket(timeout.first);
+                if (refer != nullptr) {
+                    refer->Get()->DoTimeout(timeout.second);
+                }
+            }
         }
     }
 
-    /// close all sockets
-    uint32_t pendingCount = 0;
+    /// close own sockets
+    std::vector<SocketRef*> sockets;
     {
-        MutexGuard guard(_socketsLock);
-        for (auto socket : _sockets) {
-            RefCount<Socket>* refer = socket.second;
-            refer->Get()->DoClose();
-
-            if (refer->GetRef() > 1) { pendingCount++; }
+        MutexGuard guard(theManager._socketsLock);
+        for (uint32_t index = 0; index < theManager._slotCount; index++) {
+            SocketRef* refer = theManager.GetSlot(index)->_refer.load(std::memory_order_relaxed);
+            if (refer != nullptr && refer->Get()->_loop == this) {
+                sockets.push_back(theManager.RemoveSlot(index));
+            }
         }
     }
 
-    /// wait for pending sockets, at most 5000ms 
-    DWORD startTime = GetTickCount();
+    _groups.clear();
+
+    uint32_t pendingCount = 0;
+    for (auto refer : sockets) {
+        refer->Get()->DoClose();
+
+        if (refer->GetRef() > 1) { pendingCount++; }
+    }
+
+    /// wait for pending sockets, at most 5000ms
+    uint32_t startTime = GetTickCount();
     while (pendingCount > 0 && GetTickCount() - startTime < 5000) {
-        if (Socket::DoWait() == 1) { pendingCount--; }
+        pendingCount -= std::min(pendingCount, DoWait());
     }
 
     /// clear sockets
-    {
-        MutexGuard guard(_socketsLock);
-        for (auto socket : _sockets) {
-            socket.second->DecRef();
-        }
-        _sockets.clear();
+    for (auto refer : sockets) {
+        refer->DecRef();
     }
 
     /// clear queues
@@ -596,8 +1590,233 @@ void SocketManager::MainLoop()
         MutexGuard guard(_queueLock);
         _listenQueue.clear();
         _connectQueue.clear();
-        _sendQueue.clear();
+        _adoptQueue.clear();
         _closeQueue.clear();
+        _limitQueue.clear();
+        _recvLimitQueue.clear();
+        _resumeQueue.clear();
+        _timeoutQueue.clear();
+    }
+
+    SocketSend* send = _sendQueue.exchange(nullptr, std::memory_order_acquire);
+    while (send != nullptr) {
+        SocketSend* next = send->_next;
+        if (send->_window.Get() != nullptr) {
+            send->_window->Close();
+        }
+        send->Destroy();
+        send = next;
+    }
+}
+
+void SocketLoop::Listen(uint32_t name, const std::string& addr, uint16_t port)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _listenQueue.emplace_back(name, addr, port);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::Connect(uint32_t name, const std::string& addr, uint16_t port)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _connectQueue.emplace_back(name, addr, port);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::Adopt(uint32_t name)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _adoptQueue.push_back(name);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::Transfer(uint32_t name, const PacketPtr& packet, bool close)
+{
+    SocketSend* send = SocketSend::Create(Send_One, name, packet);
+    send->_close = close;
+    Push(send);
+}
+
+void SocketLoop::Transfer(uint32_t name, const PacketPtr& packet, const StreamWindowPtr& window)
+{
+    SocketSend* send = SocketSend::Create(Send_One, name, packet);
+    send->_window = window;
+    Push(send);
+}
+
+void SocketLoop::Broadcast(const std::vector<uint32_t>& names, const PacketPtr& packet)
+{
+    SocketSend* send = SocketSend::Create(Send_List, 0, packet, names.size());
+    memcpy(send->Names(), names.data(), names.size() * sizeof(uint32_t));
+    Push(send);
+}
+
+void SocketLoop::Broadcast(uint32_t group, const PacketPtr& packet)
+{
+    Push(SocketSend::Create(Send_Group, group, packet));
+}
+
+void SocketLoop::Join(uint32_t group, uint32_t name, bool join)
+{
+    SocketSend* send = SocketSend::Create(join ? Send_Join : Send_Leave, group, PacketPtr(), 1);
+    send->Names()[0] = name;
+    Push(send);
+}
+
+void SocketLoop::Push(SocketSend* send)
+{
+    SocketSend* head = _sendQueue.load(std::memory_order_relaxed);
+    do {
+        send->_next = head;
+    } while (!_sendQueue.compare_exchange_weak(head, send));
+
+    Wake();
+}
+
+void SocketLoop::SetSendLimit(uint32_t name, const SendLimit& limit)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _limitQueue.emplace_back(name, limit);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::SetRecvLimit(uint32_t name, const RecvLimit& limit)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _recvLimitQueue.emplace_back(name, limit);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::Resume(uint32_t name)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _resumeQueue.push_back(name);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::SetTimeout(uint32_t name, const SocketTimeout& timeout)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _timeoutQueue.emplace_back(name, timeout);
+        _dirty = true;
+    }
+    Wake();
+}
+
+void SocketLoop::ShutDown(uint32_t name)
+{
+    {
+        MutexGuard guard(_queueLock);
+        _closeQueue.push_back(name);
+        _dirty = true;
+    }
+    Wake();
+}
+
+//////////////////////////////////////////////////////////////////////
+
+void SocketManager::Start(uint32_t numOfWorkThread, uint32_t numOfIoThread, uint32_t pollBatch)
+{
+    uint32_t stopped = 0;
+    if (_running.compare_exchange_strong(stopped, 2)) {
+        if (!IoPort::Initialize())
+            throw std::runtime_error("SocketManager::Start, 1");
+
+        numOfIoThread = std::max(numOfIoThread, 1u);
+        for (uint32_t i = 0; i < numOfIoThread; i++) {
+            _loops.push_back(new SocketLoop(std::max(pollBatch, 1u)));
+            if (!_loops.back()->Start())
+                throw std::runtime_error("SocketManager::Start, 4");
+        }
+
+        theDispatcher.Start(numOfWorkThread);
+
+        /// calls go through once all the loops are there
+        _running = 1;
+    }
+}
+
+void SocketManager::Close()
+{
+    theDispatcher.Close();
+
+    uint32_t running = 1;
+    if (_running.compare_exchange_strong(running, 2)) {
+        /// calls which saw it running still use the loops
+        while (_callers != 0) {
+            std::this_thread::yield();
+        }
+
+        for (auto loop : _loops) {
+            loop->Close();
+        }
+
+        /// accepted but never adopted by a loop which was closing
+        {
+            MutexGuard guard(_socketsLock);
+            for (uint32_t index = 0; index < _slotCount; index++) {
+                SocketRef* refer = RemoveSlot(index);
+                if (refer != nullptr) {
+                    refer->Get()->DoClose();
+                    refer->DecRef();
+                }
+            }
+        }
+
+        for (auto loop : _loops) {
+            delete loop;
+        }
+        _loops.clear();
+
+        IoPort::Finalize();
+        _running = 0;
+    }
+}
+
+SocketStats SocketManager::GetStats()
+{
+    SocketStats stats = {0};
+    for (auto loop : _loops) {
+        loop->GetStats(stats);
+    }
+    return stats;
+}
+
+SocketLoop* SocketManager::GetLoop(uint32_t name)
+{
+    return _loops[GetLoopIndex(name)];
+}
+
+size_t SocketManager::GetLoopIndex(uint32_t name)
+{
+    /// names are sequential, mix them before picking
+    uint32_t hash = name * 2654435761u;
+    return (hash >> 16) % _loops.size();
+}
+
+SocketManager::~SocketManager()
+{
+    for (auto& chunk : _slotChunks) {
+        delete[] chunk.load();
     }
 }
 
@@ -605,73 +1824,272 @@ uint32_t SocketManager::AddSocket(RefCount<Socket>* refer)
 {
     MutexGuard guard(_socketsLock);
 
-    while (true) {
-        uint32_t next = ++_socketsNext;
-        if (next != 0 && _sockets.find(next) == _sockets.end()) {
-            _sockets.insert(std::make_pair(next, refer));
-            refer->Get()->_name = next;
-            refer->Get()->_self = refer;
-            return next;
+    uint32_t index;
+    if (!_slotFree.empty()) {
+        index = _slotFree.front();
+        _slotFree.pop_front();
+    } else {
+        if (_slotCount > IndexMask)
+            return 0;
+
+        index = _slotCount++;
+        if ((index & (ChunkSize - 1)) == 0) {
+            SocketSlot* chunk = new SocketSlot[ChunkSize];
+            for (uint32_t i = 0; i < ChunkSize; i++) {
+                /// the first generation is 1, a name is never 0
+                chunk[i]._name = index + i + IndexMask + 1;
+                chunk[i]._refer = nullptr;
+            }
+            _slotChunks[index >> ChunkBits].store(chunk, std::memory_order_release);
         }
     }
-    return 0;
+
+    SocketSlot* slot = GetSlot(index);
+    uint32_t name = slot->_name.load(std::memory_order_relaxed);
+
+    /// only the loop of the socket takes and drops references after this
+    refer->SetLocal();
+    refer->Get()->_name = name;
+    refer->Get()->_sendLimit = _sendLimit;
+    refer->Get()->SetRecvLimit(_recvLimit);
+    refer->Get()->_timeout = _timeout;
+    refer->Get()->_self = refer;
+    refer->Get()->_loop = GetLoop(name);
+
+    slot->_refer.store(refer, std::memory_order_release);
+    return name;
+}
+
+SocketManager::SocketSlot* SocketManager::GetSlot(uint32_t index)
+{
+    SocketSlot* chunk = _slotChunks[index >> ChunkBits].load(std::memory_order_acquire);
+    return chunk != nullptr ? chunk + (index & (ChunkSize - 1)) : nullptr;
 }
 
 RefCount<Socket>* SocketManager::GetSocket(uint32_t name)
+{
+    SocketSlot* slot = GetSlot(name & IndexMask);
+    if (slot == nullptr || slot->_name.load(std::memory_order_acquire) != name)
+        return nullptr;
+
+    return slot->_refer.load(std::memory_order_acquire);
+}
+
+RefCount<Socket>* SocketManager::RemoveSocket(uint32_t name)
 {
     MutexGuard guard(_socketsLock);
-    auto iter = _sockets.find(name);
-    return iter != _sockets.end() ? iter->second : nullptr;
+
+    SocketSlot* slot = GetSlot(name & IndexMask);
+    if (slot == nullptr || slot->_name.load(std::memory_order_relaxed) != name)
+        return nullptr;
+
+    return RemoveSlot(name & IndexMask);
 }
 
-uint32_t SocketManager::Listen(const std::string& addr, uint16_t port, ServerHandlerPtr& handler)
+RefCount<Socket>* SocketManager::RemoveSlot(uint32_t index)
 {
-    if (_running == 0)
+    SocketSlot* slot = GetSlot(index);
+    RefCount<Socket>* refer = slot->_refer.load(std::memory_order_relaxed);
+    if (refer == nullptr)
+        return nullptr;
+
+    /// next generation, the old name finds no socket from now on
+    uint32_t name = slot->_name.load(std::memory_order_relaxed) + IndexMask + 1;
+    if ((name >> IndexBits) == 0) {
+        name += IndexMask + 1;
+    }
+    slot->_name.store(name, std::memory_order_release);
+    slot->_refer.store(nullptr, std::memory_order_release);
+
+    _slotFree.push_back(index);
+    return refer;
+}
+
+uint32_t SocketManager::Listen(const std::string& addr, uint16_t port, ServerHandlerPtr& handler, WireFormat wire, uint32_t compress)
+{
+    Caller caller(*this);
+    if (!caller.Running())
         return 0;
 
-    SOCKET socket = Socket::Create();
+    SOCKET socket = IoSocket::Create();
     if (socket == INVALID_SOCKET)
         return 0;
 
-    uint32_t name = AddSocket(MakeShared(new Socket(socket, handler)));
-
-    MutexGuard guard(_queueLock);
-    _listenQueue.emplace_back(name, addr, port);
-    _dirty = true;
+    RefCount<Socket>* refer = new RefCount_Inplace<Socket>(socket, handler, wire, compress);
+    uint32_t name = AddSocket(refer);
+    if (name == 0) {
+        refer->DecRef();
+        return 0;
+    }
+    GetLoop(name)->Listen(name, addr, port);
 
     return name;
 }
 
-uint32_t SocketManager::Create(const std::string& addr, uint16_t port, SocketHandlerPtr& handler)
+uint32_t SocketManager::Create(const std::string& addr, uint16_t port, SocketHandlerPtr& handler, WireFormat wire, uint32_t compress)
 {
-    if (_running == 0)
+    Caller caller(*this);
+    if (!caller.Running())
         return 0;
 
-    SOCKET socket = Socket::Create();
+    SOCKET socket = IoSocket::Create();
     if (socket == INVALID_SOCKET)
         return 0;
 
-    uint32_t name = AddSocket(MakeShared(new Socket(socket, handler)));
+    RefCount<Socket>* refer = new RefCount_Inplace<Socket>(socket, handler, wire, compress);
+    uint32_t name = AddSocket(refer);
+    if (name == 0) {
+        refer->DecRef();
+        return 0;
+    }
+    GetLoop(name)->Connect(name, addr, port);
 
-    MutexGuard guard(_queueLock);
-    _connectQueue.emplace_back(name, addr, port);
-    _dirty = true;
-    
     return name;
 }
 
-void SocketManager::Transfer(uint32_t name, PacketPtr& packet, bool close)
+void SocketManager::Transfer(uint32_t name, const PacketPtr& packet, bool close)
 {
-    MutexGuard guard(_sendLock);
-    _sendQueue.emplace_back(name, packet, close);
-    _sending = true;
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->Transfer(name, packet, close);
+}
+
+void SocketManager::Transfer(uint32_t name, const PacketPtr& packet, const StreamWindowPtr& window)
+{
+    Caller caller(*this);
+    if (!caller.Running()) {
+        window->Close();
+        return;
+    }
+
+    GetLoop(name)->Transfer(name, packet, window);
+}
+
+void SocketManager::Broadcast(const uint32_t* names, size_t count, const PacketPtr& packet)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    /// split by loop, each loop gets one push whatever the count
+    std::vector<std::vector<uint32_t>> lists(_loops.size());
+    for (size_t i = 0; i < count; i++) {
+        lists[GetLoopIndex(names[i])].push_back(names[i]);
+    }
+
+    for (size_t i = 0; i < _loops.size(); i++) {
+        if (!lists[i].empty()) {
+            _loops[i]->Broadcast(lists[i], packet);
+        }
+    }
+}
+
+void SocketManager::Broadcast(uint32_t group, const PacketPtr& packet)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    for (auto loop : _loops) {
+        loop->Broadcast(group, packet);
+    }
+}
+
+void SocketManager::Join(uint32_t group, uint32_t name)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->Join(group, name, true);
+}
+
+void SocketManager::Leave(uint32_t group, uint32_t name)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->Join(group, name, false);
+}
+
+void SocketManager::SetSendLimit(const SendLimit& limit)
+{
+    MutexGuard guard(_socketsLock);
+    _sendLimit = limit;
+}
+
+void SocketManager::SetSendLimit(uint32_t name, const SendLimit& limit)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->SetSendLimit(name, limit);
+}
+
+void SocketManager::SetRecvLimit(const RecvLimit& limit)
+{
+    MutexGuard guard(_socketsLock);
+    _recvLimit = limit;
+}
+
+void SocketManager::SetRecvLimit(uint32_t name, const RecvLimit& limit)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->SetRecvLimit(name, limit);
+}
+
+void SocketManager::SetTimeout(const SocketTimeout& timeout)
+{
+    MutexGuard guard(_socketsLock);
+    _timeout = timeout;
+}
+
+void SocketManager::SetTimeout(uint32_t name, const SocketTimeout& timeout)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->SetTimeout(name, timeout);
+}
+
+void SocketManager::Resume(uint32_t name)
+{
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->Resume(name);
+}
+
+bool SocketManager::GetSendQueue(uint32_t name, uint32_t& bytes, uint32_t& packets)
+{
+    /// sockets are released only after they left their slot under this lock
+    MutexGuard guard(_socketsLock);
+    SocketRef* refer = GetSocket(name);
+    if (refer == nullptr)
+        return false;
+
+    Socket* socket = refer->Get();
+    bytes   = socket->_sendBytes.load(std::memory_order_relaxed);
+    packets = socket->_sendCount.load(std::memory_order_relaxed);
+    return true;
 }
 
 void SocketManager::ShutDown(uint32_t name)
 {
-    MutexGuard guard(_queueLock);
-    _closeQueue.push_back(name);
-    _dirty = true;
+    Caller caller(*this);
+    if (!caller.Running())
+        return;
+
+    GetLoop(name)->ShutDown(name);
 }
 
 TINYNET_CLOSE()
\ No newline at end of file
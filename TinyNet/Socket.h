@@ -1,10 +1,11 @@
 #pragma once
-#include "Packet.h"
+#include "Wire.h"
 
 
 TINYNET_START()
 
-/// ignore send buffer overflow
+/// send queues are unbounded unless limited by SetSendLimit, so are received
+/// packets waiting for their handler unless limited by SetRecvLimit
 
 /// callbacks will always be called except that when SocketManager is closing but some sockets are still active
 
@@ -20,6 +21,21 @@ public:
     virtual void OnClose(uint32_t name) = 0;
 
     virtual void OnReceive(uint32_t name, PacketPtr& packet) = 0;
+
+    /// frames of a message written by StreamWriter in order, last is set on
+    /// the final one, a message which fit one frame goes to OnReceive instead,
+    /// dropped unless overridden, no other packet comes between the frames
+    virtual void OnStream(uint32_t name, PacketPtr& packet, bool last) { }
+
+    /// the send queue went over a high watermark of SendLimit
+    virtual void OnBackpressure(uint32_t name) { }
+
+    /// back to the low watermarks after OnBackpressure
+    virtual void OnWritable(uint32_t name) { }
+
+    /// nothing written for the write idle time of SocketTimeout, again every
+    /// time as long, the place to send a heartbeat
+    virtual void OnWriteIdle(uint32_t name) { }
 };
 
 typedef SharedPtr<SocketHandler> SocketHandlerPtr;
@@ -39,7 +55,150 @@ public:
 typedef SharedPtr<ServerHandler> ServerHandlerPtr;
 
 
+/// what a socket does with a packet which takes its send queue over a high
+/// watermark, OnBackpressure is called anyway unless it disconnects
+
+enum SendPolicy
+{
+    /// queue it all the same
+    Policy_Keep,
+
+    /// drop queued packets not being written yet, oldest first, frames of a
+    /// StreamWriter are kept
+    Policy_DropOldest,
+
+    /// drop the new packet, unless a frame of a StreamWriter
+    Policy_DropNew,
+
+    Policy_Disconnect,
+};
+
+
+/// limits of the packets queued on a socket, 0 for no limit
+
+struct SendLimit
+{
+    uint32_t      _highBytes;
+    uint32_t      _highPackets;
+
+    /// OnWritable once the queue is back to these
+    uint32_t      _lowBytes;
+    uint32_t      _lowPackets;
+
+    SendPolicy    _policy;
+};
+
+
+/// limits of the received packets of a socket not handled yet, 0 for no
+/// limit, reads are paused from a high watermark until back to both lows
+
+struct RecvLimit
+{
+    uint32_t      _highEvents;
+    uint32_t      _highBytes;
+
+    uint32_t      _lowEvents;
+    uint32_t      _lowBytes;
+};
+
+
+/// ms limits of a connection counted from when it connects, 0 for none,
+/// kept by its io loop and checked once for a Poll, up to TimeoutTick late
+
+struct SocketTimeout
+{
+    /// nothing received for so long, shut down
+    uint32_t      _readIdle;
+
+    /// nothing written for so long, OnWriteIdle
+    uint32_t      _writeIdle;
+
+    /// connected for so long, shut down
+    uint32_t      _lifetime;
+};
+
+
+/// counters of the io loops, read while running
+
+struct SocketStats
+{
+    /// Poll calls which returned completions, completions over polls is the batch
+    uint64_t    _polls;
+    uint64_t    _completions;
+
+    /// receive chunks and oversized message buffers allocated, chunks reused
+    /// in place and small packets copied out so they pin no chunk
+    uint64_t    _recvAllocs;
+    uint64_t    _recvReuses;
+    uint64_t    _recvCopies;
+
+    /// receive memory held by sockets now, over _recvSockets per connection
+    uint64_t    _recvMemory;
+    uint64_t    _recvSockets;
+
+    /// bodies of compressed packets before and after
+    uint64_t    _packRaw;
+    uint64_t    _packWire;
+
+    /// packets dropped by SendLimit policies
+    uint64_t    _sendDrops;
+
+    /// reads paused by RecvLimit
+    uint64_t    _recvPauses;
+
+    /// sockets shut down by SocketTimeout
+    uint64_t    _timeouts;
+};
+
+
+/// bytes of the frames of a StreamWriter sent and not written yet, the io
+/// loop gives them back as they are written and wakes the writer
+
+struct StreamWindow
+{
+    std::mutex                 _lock;
+    std::condition_variable    _cond;
+    size_t                     _bytes;
+
+    /// the socket is gone, nothing is given back any more
+    bool                       _closed;
+
+    /// waits until size more fit in window, one frame always does when
+    /// nothing is left, false once closed
+    bool Acquire(size_t size, size_t window)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        while (!_closed && _bytes != 0 && _bytes + size > window) {
+            _cond.wait(guard);
+        }
+
+        if (_closed)
+            return false;
+
+        _bytes += size;
+        return true;
+    }
+
+    void Release(size_t size)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _bytes -= size;
+        _cond.notify_all();
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _closed = true;
+        _cond.notify_all();
+    }
+};
+
+typedef SharedPtr<StreamWindow> StreamWindowPtr;
+
+
 class Socket;
+class SocketLoop;
 
 class SocketManager
 {
@@ -52,80 +211,304 @@ public:
     }
 
     SocketManager() :
-        _running(0),
-        _completion(NULL),
-        _thread(NULL),
-        _sending(false),
-        _dirty(false)
+        _running(0), _callers(0), _slotCount(0)
     {
+        for (auto& chunk : _slotChunks) {
+            chunk = nullptr;
+        }
+
+        memset(&_sendLimit, 0, sizeof(_sendLimit));
+        memset(&_recvLimit, 0, sizeof(_recvLimit));
+        memset(&_timeout, 0, sizeof(_timeout));
     }
 
-    void Start(uint32_t numOfWorkThread = 0);
+    ~SocketManager();
+
+    /// sockets are spread over numOfIoThread loops by name, each loop takes
+    /// at most pollBatch completions per Poll
+    void Start(uint32_t numOfWorkThread = 0, uint32_t numOfIoThread = 1, uint32_t pollBatch = 64);
     void Close();
+
+    SocketStats GetStats();
             
-    uint32_t Listen(const std::string& addr, uint16_t port, ServerHandlerPtr& handler);
+    /// a compact listener takes legacy peers too, see WireFormat, bodies of at
+    /// least compress bytes are compressed when not 0, a compact peer tells in
+    /// its preamble whether it compresses and a socket accepted from it only
+    /// compresses if it does, with legacy framing both sides have to set it
+    uint32_t Listen(const std::string& addr, uint16_t port, ServerHandlerPtr& handler,
+        WireFormat wire = Wire_Legacy, uint32_t compress = 0);
+
+    uint32_t Create(const std::string& addr, uint16_t port, SocketHandlerPtr& handler,
+        WireFormat wire = Wire_Legacy, uint32_t compress = 0);
+
+    /// held back while a StreamWriter of the socket is in the middle of a
+    /// message and sent after its last frame
+    void Transfer(uint32_t name, const PacketPtr& packet, bool close = false);
 
-    uint32_t Create(const std::string& addr, uint16_t port, SocketHandlerPtr& handler);
+    /// the packet is shared by all of them, one push per io thread
+    void Broadcast(const uint32_t* names, size_t count, const PacketPtr& packet);
 
-    void Transfer(uint32_t name, PacketPtr& packet, bool close = false);
+    /// groups live in the io threads, joins and leaves keep their order with
+    /// sends from the same thread, a closed socket leaves all its groups
+    void Join(uint32_t group, uint32_t name);
+    void Leave(uint32_t group, uint32_t name);
+
+    void Broadcast(uint32_t group, const PacketPtr& packet);
 
     void ShutDown(uint32_t name);
-private:
-    static DWORD WINAPI ThreadProc(LPVOID);
 
-    void MainLoop();
+    /// for sockets added later, and for one socket
+    void SetSendLimit(const SendLimit& limit);
+    void SetSendLimit(uint32_t name, const SendLimit& limit);
+
+    /// for sockets added later, and for one socket
+    void SetRecvLimit(const RecvLimit& limit);
+    void SetRecvLimit(uint32_t name, const RecvLimit& limit);
 
-    HANDLE      _completion;
-    HANDLE      _thread;
-    uint32_t    _running;
+    /// for sockets added later, and for one socket, a listener passes its own
+    /// to the sockets it accepts
+    void SetTimeout(const SocketTimeout& timeout);
+    void SetTimeout(uint32_t name, const SocketTimeout& timeout);
+
+    /// packets queued on the socket and their bytes with a 12 byte header each,
+    /// false when there is no such socket
+    bool GetSendQueue(uint32_t name, uint32_t& bytes, uint32_t& packets);
 private:
-    uint32_t AddSocket(RefCount<Socket>* refer);
-    
-    RefCount<Socket>* GetSocket(uint32_t name);
-    
-    Mutex       _socketsLock;   /// should use rwlock
-    uint32_t    _socketsNext;
-    std::map<uint32_t, RefCount<Socket>*>    _sockets;
+    /// loop which owns the socket, fixed for its life
+    SocketLoop* GetLoop(uint32_t name);
+
+    size_t GetLoopIndex(uint32_t name);
+
+    /// reads of a socket paused by RecvLimit, from the dispatcher
+    void Resume(uint32_t name);
+
+    /// a frame of a StreamWriter, window gets it back once written
+    void Transfer(uint32_t name, const PacketPtr& packet, const StreamWindowPtr& window);
+
+    std::vector<SocketLoop*>    _loops;
+
+    /// 1 while running, 2 while starting or closing, the loops are only
+    /// used by calls which saw 1
+    std::atomic<uint32_t>       _running;
+
+    /// calls in progress, Close waits for them before the loops go
+    std::atomic<uint32_t>       _callers;
+
+    class Caller
+    {
+        NOCOPYASSIGN(Caller);
+    public:
+        Caller(SocketManager& manager) : _manager(manager)
+        {
+            _manager._callers++;
+        }
+
+        ~Caller()
+        {
+            _manager._callers--;
+        }
+
+        bool Running() const
+        {
+            return _manager._running == 1;
+        }
+    private:
+        SocketManager& _manager;
+    };
 private:
-    struct SocketInfo
+    /// a name is the index of its slot and a generation which changes when
+    /// the slot is freed, a stale name finds another name in the slot
+    struct SocketSlot
     {
-        SocketInfo(uint32_t name, const std::string& addr, uint16_t port) :
-            _name(name), _addr(addr), _port(port) { }
-
-        uint32_t       _name;
-        std::string    _addr;
-        uint16_t       _port;
+        std::atomic<uint32_t>             _name;
+        std::atomic<RefCount<Socket>*>    _refer;
     };
 
-    struct SocketSend
-    {
-        SocketSend(uint32_t name, PacketPtr& data, bool close) :
-            _name(name), _data(data), _close(close) { }
+    static const uint32_t IndexBits = 20;
+    static const uint32_t IndexMask = (1u << IndexBits) - 1;
 
-        uint32_t     _name;
-        PacketPtr    _data;
-        bool         _close;
-    };
+    /// slots are allocated a chunk at a time and never move
+    static const uint32_t ChunkBits  = 12;
+    static const uint32_t ChunkSize  = 1u << ChunkBits;
+    static const uint32_t ChunkCount = (IndexMask + 1) >> ChunkBits;
+
+    /// 0 when every slot is taken
+    uint32_t AddSocket(RefCount<Socket>* refer);
+
+    /// takes no lock, for the loop owning the socket, which is the only one to
+    /// remove it, or under _socketsLock
+    RefCount<Socket>* GetSocket(uint32_t name);
 
-    bool    _dirty;
+    RefCount<Socket>* RemoveSocket(uint32_t name);
 
-    Mutex   _queueLock;
+    /// under _socketsLock, nullptr if the slot is free
+    RefCount<Socket>* RemoveSlot(uint32_t index);
 
-    std::vector<SocketInfo>    _listenQueue;
+    SocketSlot* GetSlot(uint32_t index);
 
-    std::vector<SocketInfo>    _connectQueue;
+    /// adds and removes, and reads of sockets by other threads
+    Mutex       _socketsLock;
 
-    std::vector<uint32_t>      _closeQueue;
+    std::atomic<SocketSlot*>    _slotChunks[ChunkCount];
+    uint32_t                    _slotCount;
 
-    bool     _sending;
-    
-    Mutex    _sendLock;
+    /// oldest first, a name comes back as late as possible
+    std::deque<uint32_t>        _slotFree;
 
-    std::vector<SocketSend>    _sendQueue;
+    /// given to sockets when added
+    SendLimit    _sendLimit;
+    RecvLimit    _recvLimit;
+    SocketTimeout    _timeout;
 
     friend class Socket;
+    friend class SocketLoop;
+    friend class Dispatcher;
+    friend class StreamWriter;
 };
 
 #define theManager SocketManager::Instance()
 
+
+/// writes a message of any size as a sequence of frames, each sent once it
+/// is full, only one StreamWriter at a time for a socket, other packets sent
+/// to the socket before Close wait for the last frame
+
+/// a frame waits while more than window bytes of frames before it are not
+/// written yet, so a message is never queued whole, keep window under the high
+/// watermarks of SendLimit, Write throws once the socket is gone
+
+class StreamWriter
+{
+    NOCOPYASSIGN(StreamWriter);
+public:
+    /// fits the 16K pool class
+    static const size_t DefFrameSize = 16000;
+
+    static const size_t DefWindow = 4 * DefFrameSize;
+
+    StreamWriter(uint32_t name, int32_t type, int32_t guid, size_t frameSize = DefFrameSize,
+        size_t window = DefWindow) :
+        _name(name), _type(type), _guid(guid), _window(window), _closed(false)
+    {
+        _stream = MakeShared<StreamWindow>();
+        _stream->_bytes = 0;
+        _stream->_closed = false;
+
+        _frameSize = std::max(Packet::MinCapacity, std::min(frameSize, (size_t)Packet::MaxCapacity));
+        NewFrame();
+    }
+
+    /// sends what is left if not closed yet
+    ~StreamWriter()
+    {
+        Close();
+    }
+
+    void Write(const void* data, size_t size)
+    {
+        if (_closed)
+            throw std::runtime_error("StreamWriter::Write, Closed");
+
+        const uint8_t* from = (const uint8_t*)data;
+        while (size > 0) {
+            if (_packet->_used == _frameSize) {
+                if (!SendFrame(true)) {
+                    _closed = true;
+                    _packet.Reset();
+                    throw std::runtime_error("StreamWriter::Write, Socket Closed");
+                }
+                NewFrame();
+            }
+
+            size_t count = std::min(size, _frameSize - _packet->_used);
+            memcpy(_base, from, count);
+            _base += count;
+            _packet->_used += count;
+
+            from += count;
+            size -= count;
+        }
+    }
+
+    void Write(const char* text)
+    {
+        uint32_t length = strlen(text);
+        operator<<(length);
+        Write(text, length + 1);
+    }
+
+    template<class T>
+    StreamWriter& operator<<(const T& val)
+    {
+        static_assert(!std::is_pointer<T>::value && !std::is_reference<T>::value && std::is_pod<T>::value, "Invalid Type");
+
+        Write(&val, sizeof(T));
+        return *this;
+    }
+
+    template<class T>
+    StreamWriter& operator<<(const std::vector<T>& arr)
+    {
+        static_assert(!std::is_pointer<T>::value && !std::is_reference<T>::value && std::is_pod<T>::value, "Invalid Type");
+
+        operator<<((uint32_t)arr.size());
+        Write(arr.data(), arr.size() * sizeof(T));
+        return *this;
+    }
+
+    StreamWriter& operator<<(const std::string& text)
+    {
+        operator<<((uint32_t)text.size());
+        Write(text.c_str(), text.size() + 1);
+        return *this;
+    }
+
+    /// the last frame may be empty
+    void Close()
+    {
+        if (!_closed) {
+            _closed = true;
+            SendFrame(false);
+            _packet.Reset();
+        }
+    }
+private:
+    void NewFrame()
+    {
+        _packet = Packet::Create(_frameSize);
+        _packet->_type = _type;
+        _packet->_guid = _guid;
+
+        _base = (uint8_t*)(_packet.Get() + 1);
+    }
+
+    /// false when the socket is gone
+    bool SendFrame(bool more)
+    {
+        /// the io loop wakes us as frames are written, a handler may wait here
+        size_t size = _packet->_used + 12;
+        if (!_stream->Acquire(size, _window))
+            return false;
+
+        _packet->_used |= Packet::StreamFlag;
+        if (more) {
+            _packet->_used |= Packet::MoreFlag;
+        }
+        theManager.Transfer(_name, _packet, _stream);
+        return true;
+    }
+
+    uint32_t     _name;
+    int32_t      _type;
+    int32_t      _guid;
+    size_t       _frameSize;
+    size_t       _window;
+
+    /// frames sent and not written yet
+    StreamWindowPtr    _stream;
+    bool         _closed;
+    uint8_t*     _base;
+    PacketPtr    _packet;
+};
+
 TINYNET_CLOSE()
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "Wire.h"
+
+
+TINYNET_START()
+
+namespace {
+
+const uint32_t FlagGuid = 1;
+const uint32_t FlagMore = 2;
+const uint32_t FlagPack = 4;
+const uint32_t FlagBits = 3;
+
+inline uint32_t ZigZag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t UnZigZag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+inline size_t PutVarint(uint8_t* data, uint32_t value)
+{
+    size_t count = 0;
+    while (value >= 0x80) {
+        data[count++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    data[count++] = (uint8_t)value;
+    return count;
+}
+
+/// 1 when read, 0 when the data ends first, -1 when longer than 5 bytes
+inline int GetVarint(const uint8_t*& at, const uint8_t* end, uint32_t& value)
+{
+    value = 0;
+    for (uint32_t shift = 0; at < end; shift += 7) {
+        if (shift > 28)
+            return -1;
+
+        uint8_t byte = *at++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+inline void PutWord(uint8_t* data, uint32_t value)
+{
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+    data[2] = (uint8_t)(value >> 16);
+    data[3] = (uint8_t)(value >> 24);
+}
+
+inline uint32_t GetWord(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+}
+
+const uint8_t Wire::Preamble[4] = { 0x01, 0x00, 0x57, 0x7E };
+
+const uint8_t Wire::PackPreamble[4] = { 0x01, 0x01, 0x57, 0x7E };
+
+size_t Wire::EncodeHead(WireFormat format, const Packet* packet, uint8_t* head)
+{
+    if (format == Wire_Legacy) {
+        PutWord(head, packet->_used);
+        PutWord(head + 4, (uint32_t)packet->_type);
+        PutWord(head + 8, (uint32_t)packet->_guid);
+        return 12;
+    }
+
+    uint32_t flags = 0;
+    if (packet->_guid != 0) { flags |= FlagGuid; }
+    if (packet->_used & Packet::MoreFlag) { flags |= FlagMore; }
+    if (packet->_used & Packet::PackFlag) { flags |= FlagPack; }
+
+    size_t size = PutVarint(head, (packet->_used & ~Packet::FlagMask) << FlagBits | flags);
+    size += PutVarint(head + size, ZigZag(packet->_type));
+    if (flags & FlagGuid) {
+        size += PutVarint(head + size, ZigZag(packet->_guid));
+    }
+    return size;
+}
+
+size_t Wire::DecodeHead(WireFormat format, const uint8_t* data, size_t size, WireHead& head)
+{
+    if (format == Wire_Legacy) {
+        if (size < 12)
+            return 0;
+
+        uint32_t used = GetWord(data);
+        head._used = used & ~Packet::FlagMask;
+        head._more = (used & Packet::MoreFlag) != 0;
+        head._packed = (used & Packet::PackFlag) != 0;
+        head._type = (int32_t)GetWord(data + 4);
+        head._guid = (int32_t)GetWord(data + 8);
+        return 12;
+    }
+
+    const uint8_t* at  = data;
+    const uint8_t* end = data + size;
+
+    uint32_t first, type, guid = 0;
+    int status = GetVarint(at, end, first);
+    if (status > 0) {
+        status = GetVarint(at, end, type);
+    }
+    if (status > 0 && (first & FlagGuid)) {
+        status = GetVarint(at, end, guid);
+    }
+
+    if (status < 0)
+        return Invalid;
+    if (status == 0)
+        return 0;
+
+    head._used = first >> FlagBits;
+    head._more = (first & FlagMore) != 0;
+    head._packed = (first & FlagPack) != 0;
+    head._type = UnZigZag(type);
+    head._guid = UnZigZag(guid);
+    return at - data;
+}
+
+TINYNET_CLOSE()
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include "Packet.h"
+
+
+TINYNET_START()
+
+/// framing of packets on a connection, chosen per listener and per
+/// outgoing socket
+
+enum WireFormat
+{
+    /// _used, _type, _guid as 32 bit words, then the body, words are sent
+    /// straight from the packet in host order and read as little endian, so
+    /// both ends have to be little endian
+    Wire_Legacy,
+
+    /// varint length with flags, zigzag varint type and optional guid, the
+    /// connecting side starts with Wire::Preamble, or PackPreamble when it
+    /// compresses, a compact listener takes legacy peers too, a peer silent
+    /// for 500 ms is taken for legacy, so one waiting for the server to speak
+    /// first is served after that
+    Wire_Compact,
+};
+
+
+/// header fields of one frame
+struct WireHead
+{
+    uint32_t   _used;
+    int32_t    _type;
+    int32_t    _guid;
+    bool       _more;
+    bool       _packed;
+};
+
+
+class Wire
+{
+public:
+    /// read as a legacy length it is far over the limit whatever flags are
+    /// taken off, the first byte is the version
+    static const uint8_t Preamble[4];
+
+    /// the second byte says the sender compresses and takes compressed packets
+    static const uint8_t PackPreamble[4];
+
+    /// most bytes of any header
+    static const size_t HeadMax = 16;
+
+    /// DecodeHead on bytes which are not a header
+    static const size_t Invalid = SIZE_MAX;
+
+    /// writes at most HeadMax bytes, returns the length
+    static size_t EncodeHead(WireFormat format, const Packet* packet, uint8_t* head);
+
+    /// returns the header length, 0 when size does not cover it yet
+    static size_t DecodeHead(WireFormat format, const uint8_t* data, size_t size, WireHead& head);
+};
+
+TINYNET_CLOSE()
\ No newline at end of file